@@ -0,0 +1,392 @@
+/*
+ * ptybench: drives shellgibi through a pseudo-terminal and measures its hot paths.
+ *
+ *   cc -O2 -Wall -o bench/ptybench bench/ptybench.c -lutil
+ *   bench/ptybench [options] ./shellgibi > results.json
+ *
+ * Every scenario starts a fresh shell on its own pty, waits for the prompt and
+ * times round trips from the bytes written to the bytes the shell echoes back:
+ *
+ *   launch    N sequential /bin/true commands, Enter to the next prompt
+ *   pipeline  cat /dev/zero | cat ... | head -c BYTES, M stages, whole run
+ *   complete  Tab against a synthetic PATH directory of many executables
+ *   echo      one keystroke to its echo in prompt()
+ *
+ * The results are printed as one JSON object with p50/p99/mean/max latencies in
+ * microseconds per scenario, plus throughput where it makes sense.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pty.h>
+#include <sys/stat.h>
+
+#define PROMPT_MARKER "shellgibi$ "
+#define TIMEOUT_MS 60000
+
+struct options {
+    const char *shell;
+    int launches;       // launch: number of /bin/true commands
+    int stages;         // pipeline: number of processes in the pipeline
+    long long bytes;    // pipeline: bytes pushed through it per run
+    int runs;           // pipeline: number of runs
+    int executables;    // complete: files in the synthetic PATH directory
+    int tabs;           // complete: number of Tab presses
+    int keys;           // echo: number of keystrokes
+    const char *only;   // run a single scenario
+};
+
+struct shell_t {
+    pid_t pid;
+    int fd;
+    char tail[64];      // end of the previous read, a marker may span two reads
+    int tail_len;
+    long long received; // bytes read from the pty
+};
+
+struct result_t {
+    const char *name;
+    double *samples;    // microseconds
+    int count;
+    double bytes;       // payload per sample for throughput, 0 if not meaningful
+    bool failed;
+};
+
+double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e6+ts.tv_nsec/1e3;
+}
+/**
+ * Start the shell on a new pty
+ * @param  path    shellgibi binary
+ * @param  envpath PATH for the shell, NULL to keep ours
+ * @return         0 on success, -1 otherwise
+ */
+int shell_start(struct shell_t *sh, const char *path, const char *histfile, const char *envpath)
+{
+    struct winsize ws={.ws_row=50, .ws_col=200};
+    memset(sh, 0, sizeof(*sh));
+    sh->pid=forkpty(&sh->fd, NULL, NULL, &ws);
+    if (sh->pid==-1) {
+        perror("forkpty");
+        return -1;
+    }
+    if (sh->pid==0) {
+        setenv("SHELLGIBI_HISTFILE", histfile, 1);
+        if (envpath!=NULL)
+            setenv("PATH", envpath, 1);
+        execl(path, path, (char *)NULL);
+        perror(path);
+        _exit(127);
+    }
+    return 0;
+}
+/**
+ * Read from the shell until the marker shows up
+ * @return 0 when it was seen, -1 on timeout or when the shell went away
+ */
+int shell_expect(struct shell_t *sh, const char *marker)
+{
+    char buf[65536+sizeof(sh->tail)];
+    int mlen=strlen(marker);
+    double deadline=now_us()+TIMEOUT_MS*1000.0;
+    while (1) {
+        int left=(deadline-now_us())/1000;
+        struct pollfd pfd={.fd=sh->fd, .events=POLLIN};
+        if (left<=0 || poll(&pfd, 1, left)<=0) {
+            fprintf(stderr, "ptybench: timed out waiting for \"%s\"\n", marker);
+            return -1;
+        }
+        memcpy(buf, sh->tail, sh->tail_len);
+        ssize_t n=read(sh->fd, buf+sh->tail_len, sizeof(buf)-sh->tail_len);
+        if (n<0 && errno==EINTR)
+            continue;
+        if (n<=0)
+            return -1;
+        sh->received+=n;
+        int len=sh->tail_len+n;
+        char *found=memmem(buf, len, marker, mlen);
+        if (found!=NULL) {
+            // keep what came after the marker, it belongs to the next expectation
+            int rest=len-(found-buf)-mlen;
+            if (rest>(int)sizeof(sh->tail))
+                rest=0;
+            memcpy(sh->tail, found+mlen, rest);
+            sh->tail_len=rest;
+            return 0;
+        }
+        int keep=mlen-1<len ? mlen-1 : len;
+        memcpy(sh->tail, buf+len-keep, keep);
+        sh->tail_len=keep;
+    }
+}
+int shell_send(struct shell_t *sh, const char *text, int len)
+{
+    while (len>0) {
+        ssize_t n=write(sh->fd, text, len);
+        if (n<0 && errno==EINTR)
+            continue;
+        if (n<0)
+            return -1;
+        text+=n;
+        len-=n;
+    }
+    return 0;
+}
+/**
+ * Time one round trip: send the text and wait for the marker
+ * @return the latency in microseconds, or a negative value on failure
+ */
+double shell_roundtrip(struct shell_t *sh, const char *text, const char *marker)
+{
+    double start=now_us();
+    if (shell_send(sh, text, strlen(text))==-1 || shell_expect(sh, marker)==-1)
+        return -1;
+    return now_us()-start;
+}
+void shell_stop(struct shell_t *sh)
+{
+    int status;
+    shell_send(sh, "exit\n", 5);
+    for (int i=0; i<100; i++) {
+        if (waitpid(sh->pid, &status, WNOHANG)==sh->pid) {
+            close(sh->fd);
+            return;
+        }
+        usleep(10000);
+    }
+    kill(sh->pid, SIGKILL);
+    waitpid(sh->pid, &status, 0);
+    close(sh->fd);
+}
+
+/*
+ * Scenarios: each one fills in a result and leaves no shell behind.
+ */
+void result_init(struct result_t *r, const char *name, int count)
+{
+    memset(r, 0, sizeof(*r));
+    r->name=name;
+    r->samples=calloc(count>0 ? count : 1, sizeof(double));
+}
+/**
+ * Record a sample
+ * @return false if the scenario has to stop
+ */
+bool result_add(struct result_t *r, double us)
+{
+    if (us<0) {
+        r->failed=true;
+        return false;
+    }
+    r->samples[r->count++]=us;
+    return true;
+}
+
+void bench_launch(struct result_t *r, const struct options *o, const char *histfile)
+{
+    struct shell_t sh;
+    result_init(r, "launch", o->launches);
+    if (shell_start(&sh, o->shell, histfile, NULL)==-1 || shell_expect(&sh, PROMPT_MARKER)==-1) {
+        r->failed=true;
+        return;
+    }
+    for (int i=0; i<o->launches; i++)
+        if (!result_add(r, shell_roundtrip(&sh, "/bin/true\n", PROMPT_MARKER)))
+            break;
+    shell_stop(&sh);
+}
+
+void bench_pipeline(struct result_t *r, const struct options *o, const char *histfile)
+{
+    struct shell_t sh;
+    char line[4096];
+    int len=snprintf(line, sizeof(line), "cat /dev/zero");
+    for (int i=2; i<o->stages && len<(int)sizeof(line)-100; i++)
+        len+=snprintf(line+len, sizeof(line)-len, " | cat");
+    snprintf(line+len, sizeof(line)-len, " | head -c %lld > /dev/null\n", o->bytes);
+
+    result_init(r, "pipeline", o->runs);
+    r->bytes=o->bytes;
+    if (shell_start(&sh, o->shell, histfile, NULL)==-1 || shell_expect(&sh, PROMPT_MARKER)==-1) {
+        r->failed=true;
+        return;
+    }
+    for (int i=0; i<o->runs; i++)
+        if (!result_add(r, shell_roundtrip(&sh, line, PROMPT_MARKER)))
+            break;
+    shell_stop(&sh);
+}
+
+void bench_complete(struct result_t *r, const struct options *o, const char *histfile, const char *dir)
+{
+    struct shell_t sh;
+    char path[PATH_MAX+32], envpath[PATH_MAX+4096];
+    result_init(r, "complete", o->tabs);
+
+    // sgb_00000 ... sgb_09999, a prefix of all but the last digit matches ten of them
+    for (int i=0; i<o->executables; i++) {
+        snprintf(path, sizeof(path), "%s/sgb_%05d", dir, i);
+        int fd=open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+        if (fd==-1) {
+            perror(path);
+            r->failed=true;
+            return;
+        }
+        close(fd);
+    }
+    snprintf(envpath, sizeof(envpath), "%s:%s", dir, getenv("PATH") ? getenv("PATH") : "/usr/bin:/bin");
+    if (shell_start(&sh, o->shell, histfile, envpath)==-1 || shell_expect(&sh, PROMPT_MARKER)==-1) {
+        r->failed=true;
+        return;
+    }
+    for (int i=0; i<o->tabs; i++) {
+        char word[32];
+        snprintf(word, sizeof(word), "sgb_%04d\t", (i*7919)%((o->executables+9)/10));
+        if (!result_add(r, shell_roundtrip(&sh, word, PROMPT_MARKER)))
+            break;
+    }
+    shell_stop(&sh);
+}
+
+void bench_echo(struct result_t *r, const struct options *o, const char *histfile)
+{
+    struct shell_t sh;
+    int typed=0;
+    result_init(r, "echo", o->keys);
+    if (shell_start(&sh, o->shell, histfile, NULL)==-1 || shell_expect(&sh, PROMPT_MARKER)==-1) {
+        r->failed=true;
+        return;
+    }
+    for (int i=0; i<o->keys; i++) {
+        char key[2]={'a'+i%26, 0};
+        if (!result_add(r, shell_roundtrip(&sh, key, key)))
+            break;
+        if (++typed==200) {  // stay well inside the prompt's line buffer
+            while (typed-->0)
+                if (shell_send(&sh, "\x7f", 1)==-1 || shell_expect(&sh, "\b \b")==-1) {
+                    r->failed=true;
+                    break;
+                }
+            typed=0;
+        }
+    }
+    shell_stop(&sh);
+}
+
+/*
+ * Reporting
+ */
+int compare_double(const void *a, const void *b)
+{
+    double x=*(const double *)a, y=*(const double *)b;
+    return x<y ? -1 : x>y;
+}
+double percentile(const double *sorted, int count, double q)
+{
+    return sorted[(int)((count-1)*q+0.5)];
+}
+void result_print(const struct result_t *r, bool last)
+{
+    printf("    \"%s\": {\"ok\": %s, \"samples\": %d", r->name, r->failed ? "false" : "true", r->count);
+    if (r->count>0) {
+        double total=0;
+        qsort(r->samples, r->count, sizeof(double), compare_double);
+        for (int i=0; i<r->count; i++)
+            total+=r->samples[i];
+        printf(", \"p50_us\": %.1f, \"p99_us\": %.1f, \"mean_us\": %.1f, \"max_us\": %.1f",
+               percentile(r->samples, r->count, 0.5), percentile(r->samples, r->count, 0.99),
+               total/r->count, r->samples[r->count-1]);
+        if (r->bytes>0)
+            printf(", \"throughput_mb_s\": %.1f", r->bytes*r->count/total);  // bytes/us is MB/s
+        else
+            printf(", \"ops_per_s\": %.1f", r->count*1e6/total);
+    }
+    printf("}%s\n", last ? "" : ",");
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: ptybench [-n launches] [-m stages] [-b bytes] [-r runs]\n"
+                    "                [-e executables] [-t tabs] [-k keys]\n"
+                    "                [-s launch|pipeline|complete|echo] shellgibi\n");
+    exit(2);
+}
+int main(int argc, char *argv[])
+{
+    struct options o={
+        .launches=1000, .stages=4, .bytes=2LL<<30, .runs=3,
+        .executables=10000, .tabs=200, .keys=2000,
+    };
+    int c;
+    while ((c=getopt(argc, argv, "n:m:b:r:e:t:k:s:"))!=-1) {
+        switch (c) {
+        case 'n': o.launches=atoi(optarg); break;
+        case 'm': o.stages=atoi(optarg); break;
+        case 'b': o.bytes=atoll(optarg); break;
+        case 'r': o.runs=atoi(optarg); break;
+        case 'e': o.executables=atoi(optarg); break;
+        case 't': o.tabs=atoi(optarg); break;
+        case 'k': o.keys=atoi(optarg); break;
+        case 's': o.only=optarg; break;
+        default: usage();
+        }
+    }
+    if (optind!=argc-1 || o.stages<2 || o.executables<10)
+        usage();
+    o.shell=argv[optind];
+    signal(SIGPIPE, SIG_IGN);
+
+    // history and the synthetic PATH live in a scratch directory
+    char dir[]="/tmp/ptybench.XXXXXX", histfile[PATH_MAX], bindir[PATH_MAX];
+    if (mkdtemp(dir)==NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(histfile, sizeof(histfile), "%s/history", dir);
+    snprintf(bindir, sizeof(bindir), "%s/bin", dir);
+    mkdir(bindir, 0755);
+
+    struct result_t results[4];
+    int n=0;
+    if (o.only==NULL || strcmp(o.only, "launch")==0)
+        bench_launch(&results[n++], &o, histfile);
+    if (o.only==NULL || strcmp(o.only, "pipeline")==0)
+        bench_pipeline(&results[n++], &o, histfile);
+    if (o.only==NULL || strcmp(o.only, "complete")==0)
+        bench_complete(&results[n++], &o, histfile, bindir);
+    if (o.only==NULL || strcmp(o.only, "echo")==0)
+        bench_echo(&results[n++], &o, histfile);
+
+    printf("{\n  \"shell\": \"%s\",\n  \"results\": {\n", o.shell);
+    bool failed=false;
+    for (int i=0; i<n; i++) {
+        result_print(&results[i], i==n-1);
+        failed|=results[i].failed;
+        free(results[i].samples);
+    }
+    printf("  }\n}\n");
+
+    char path[PATH_MAX+32];
+    for (int i=0; i<o.executables; i++) {
+        snprintf(path, sizeof(path), "%s/sgb_%05d", bindir, i);
+        unlink(path);
+    }
+    rmdir(bindir);
+    unlink(histfile);
+    rmdir(dir);
+    return failed ? 1 : 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <sys/wait.h>
 #include <stdio.h>
@@ -7,30 +8,194 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <dirent.h>
+#include <spawn.h>
+#include <time.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <fnmatch.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/uio.h>
+#include <setjmp.h>
 
-#define HISTORY_SIZE 10
+#define HISTORY_SIZE 10    // number of lines the history command shows by default
 const char * sysname = "shellgibi";
 
-char* history[HISTORY_SIZE];    // custom command: an array to keep the history of commands
-int curind=0;
-int histflag=0;
+int last_status=0;  // exit status of the last foreground command or pipeline
+int interactive=0;  // stdin is a terminal we can hand to foreground process groups
+bool exit_requested=false;  // set by the exit builtin
+volatile sig_atomic_t interrupted=0;  // ^C while a line runs, it stops the loops of the line
 
 enum return_codes {
     SUCCESS = 0,
     EXIT = 1,
     UNKNOWN = 2,
 };
+enum redirect_types {
+    REDIRECT_IN = 0,        // [n]<file
+    REDIRECT_OUT = 1,       // [n]>file
+    REDIRECT_APPEND = 2,    // [n]>>file
+    REDIRECT_DUP = 3,       // [n]>&m and [n]<&m, a target of - closes n
+    REDIRECT_STRING = 4,    // [n]<<<word, a here-string
+};
+struct redirect_t {
+    int fd;             // descriptor of the command it changes
+    int type;
+    char *target;       // file name, descriptor number or word, NULL if missing
+    bool raw;           // target is still quoted and has substitutions, see expand_command()
+    struct redirect_t *next;
+};
+struct node_t;
+struct rctl_t;
 struct command_t {
     char *name;
     bool background;
     bool auto_complete;
+    bool timed;         // behind the time prefix
     int arg_count;
     char **args;
-    char *redirects[3]; // in/out redirection
+    char *expand;       // expand[i] is EXPAND_GLOB or EXPAND_RAW for args[i], NULL if no argument needs either
+    bool name_raw;      // name is still quoted and has substitutions
+    char **assigns;     // name=value words before the name, values still quoted
+    int assign_count;
+    char **env_names, **env_values; // the assignments expanded, exported to this stage alone
+    int env_count;
+    struct redirect_t *redirects; // applied in the order they were written, after the pipes
     struct command_t *next; // for piping
+    struct node_t *subshell;    // ( list ) stage, run in a forked copy of the shell
+    struct rctl_t *rctl;        // behind the rctl prefix, applied in the child before exec
+    struct arena_t *arena;  // where the command and its strings are allocated
+};
+enum expand_types {
+    EXPAND_NONE = 0,
+    EXPAND_GLOB = 1,    // a pattern, quoted special characters escaped with a backslash
+    EXPAND_RAW = 2,     // the word as typed, it has command substitutions
+};
+enum node_types {
+    NODE_PIPELINE = 0,  // command and the stages linked to it
+    NODE_AND = 1,       // left && right
+    NODE_OR = 2,        // left || right
+    NODE_SEQ = 3,       // left ; right, or left & right
+    NODE_FOR = 4,       // for command->name in command->args; do body; done
+    NODE_WHILE = 5,     // while left; do body; done
+    NODE_UNTIL = 6,     // until left; do body; done
+    NODE_IF = 7,        // if left; then body; else right; fi, an elif is an if in right
+    NODE_FUNCTION = 8,  // command->name() text, defines the function when it runs
+};
+struct node_t {  // parsed command line
+    int type;
+    struct command_t *command;
+    struct node_t *left, *right;
+    struct node_t *body;    // what a loop or an if runs
+    char *text;             // body of a function definition as typed
+};
+enum jump_types {
+    JUMP_NONE = 0,
+    JUMP_BREAK = 1,     // break [n], leaves jump_levels loops
+    JUMP_CONTINUE = 2,  // continue [n]
+    JUMP_RETURN = 3,    // return from the running function
+};
+enum builtin_flags {
+    BUILTIN_PARENT = 1,  // runs inside the shell process when it is a command of its own
+    BUILTIN_PIPE = 2,    // may be a pipeline stage, then it runs in a forked child without exec
+};
+struct builtin_t {
+    const char *name;
+    int (*handler)(struct command_t *command);  // returns the exit status
+    int flags;
 };
+const struct builtin_t *find_builtin(const char *name);
+void history_init();
+void history_add(const char *line);
+long history_count();
+const char *history_get(long i, int *len);
 const char* findPath(char *cmd);
-void runPipe (struct command_t *command, int fdtmp);
+void hash_flush();
+void hash_print();
+int autocomplete(struct command_t *command);
+int compare_names(const void *a, const void *b);
+int expand_command(struct command_t *command);
+extern long dir_cache_hits, dir_cache_misses;
+int runPipe (struct command_t *command);
+void make_argv(struct command_t *command);
+void launch_init();
+void launch_report();
+int launch_select(const char *mode);
+int launch_wait(char **argv);
+int redirect_builtin(const struct builtin_t *builtin, struct command_t *command);
+int zygote_start();
+int zygote_main(int fd);
+void jobs_init();
+void sigchld_handler(int sig);
+void job_notify();
+bool job_notify_pending();
+void job_reap();
+int status_code(int status);
+void block_sigchld(sigset_t *old);
+extern const int job_signals[];
+void zygote_detach();
+int subshell_run(struct node_t *list);
+struct capture_t;
+extern size_t capture_size;
+void capture_init();
+int capture_config(const char *size);
+void capture_list();
+int capture_show(const char *spec, bool follow);
+int capture_read_fd(int fd);
+void capture_wait(const sigset_t *mask);
+void capture_finish(struct capture_t *capture);
+void jobs_list();
+int job_continue(const char *name, const char *spec, bool foreground, bool allow_pid);
+int jobs_kill(const char *name, int sig, char **argv, int argc);
+int parse_signal(const char *arg);
+int execute_command(struct command_t *command);
+int execute_stages(struct command_t *command);
+int execute_node(struct node_t *node);
+struct command_t *command_copy(struct arena_t *arena, struct command_t *command);
+extern int jump, jump_levels, loop_depth, function_depth;
+extern pid_t shell_pid, shell_pgid;
+const char *var_get(const char *name);
+void var_set(const char *name, const char *value);
+void var_unset(const char *name);
+struct function_t;
+struct function_t *function_find(const char *name);
+int function_define(const char *name, const char *text);
+int function_remove(const char *name);
+int function_call(struct function_t *f, struct command_t *command, bool subshell);
+char *word_expand_string(struct arena_t *arena, const char *word);
+struct node_t *parse_line(char *buf, struct arena_t *arena, bool *incomplete);
+struct command_t *line_last(struct node_t *tree);
+int time_command(struct command_t *command);
+int parallel_run(struct command_t *command);
+int rctl_parse(struct command_t *command);
+void trace_init();
+int trace_open(const char *file);
+struct job_t;
+void trace_job(struct job_t *job);
+void trace_builtin(const char *name, double start, double end, int status);
+double wall_us();
+extern int trace_fd;
+extern int alarm_fd;
+int alarm_run_due();
+int alarm_add(time_t deadline, char **argv, int argc);
+time_t alarm_parse_time(const char *spec);
+void alarm_list();
+int alarm_cancel(int id);
+const char *redirect_ops[]={"<", ">", ">>", ">&", "<<<"};
 /**
  * Prints a command struct
  * @param struct command_t *
@@ -42,8 +207,8 @@ void print_command(struct command_t * command)
     printf("\tIs Background: %s\n", command->background?"yes":"no");
     printf("\tNeeds Auto-complete: %s\n", command->auto_complete?"yes":"no");
     printf("\tRedirects:\n");
-    for (i=0;i<3;i++)
-        printf("\t\t%d: %s\n", i, command->redirects[i]?command->redirects[i]:"N/A");
+    for (struct redirect_t *r=command->redirects; r!=NULL; r=r->next)
+        printf("\t\t%d: %s %s\n", r->fd, redirect_ops[r->type], r->target?r->target:"N/A");
     printf("\tArguments (%d):\n", command->arg_count);
     for (i=0;i<command->arg_count;++i)
         printf("\t\tArg %d: %s\n", i, command->args[i]);
@@ -54,680 +219,6933 @@ void print_command(struct command_t * command)
     }
 
 
+}
+/*
+ * Arena allocator for parsed command lines: the command_t stages, argument
+ * vectors and strings of a line are bumped out of one arena and released together
+ * with arena_reset(). A reset keeps the largest chunk, so once it fits a typical
+ * line, parsing does not call malloc() at all.
+ */
+#define ARENA_CHUNK 4096
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+struct arena_t {
+    struct arena_chunk *chunks;  // the chunk being filled comes first
+    struct arena_chunk *spare;   // largest chunk given back by arena_release(), reused first
+    long mallocs;               // chunks allocated over the arena's lifetime
+    long mallocs_line;          // chunks allocated since the last reset
+    size_t used_line;           // bytes handed out since the last reset
+};
+struct arena_t line_arena;      // holds the line being executed
+struct arena_t exec_arena;      // expanded copies of the commands being run, see execute_command()
+struct arena_mark {
+    struct arena_chunk *chunk;
+    size_t used;
+};
+long lines_parsed=0;
+
+/*
+ * Running out of memory fails the line being run: the shell jumps back to the
+ * loop that started it, which starts over with the next line. A forked stage
+ * just exits.
+ */
+sigjmp_buf line_abort;
+pid_t line_abort_pid=0;         // process that armed line_abort, 0 when nothing did
+
+void out_of_memory()
+{
+    fprintf(stderr, "-%s: out of memory\n", sysname);
+    last_status=1;
+    if (line_abort_pid!=getpid())
+        _exit(1);
+    jump=jump_levels=loop_depth=function_depth=0;  // every loop and function of the line is abandoned
+    siglongjmp(line_abort, 1);
 }
 /**
- * Release allocated memory of a command
- * @param  command [description]
- * @return         [description]
+ * Allocate n bytes, aligned for any type
  */
-int free_command(struct command_t *command)
+void *arena_alloc(struct arena_t *arena, size_t n)
 {
-    if (command->arg_count)
-    {
-        for (int i=0; i<command->arg_count; ++i)
-            free(command->args[i]);
-        free(command->args);
+    struct arena_chunk *c=arena->chunks;
+    n=(n+15) & ~(size_t)15;
+    if (c==NULL || c->used+n>c->size) {
+        size_t size=c ? c->size*2 : ARENA_CHUNK;
+        if (size<n)
+            size=n;
+        if (arena->spare!=NULL && arena->spare->size>=n) {
+            c=arena->spare;
+            arena->spare=NULL;
+        } else {
+            c=malloc(sizeof(struct arena_chunk)+size);
+            if (c==NULL)
+                out_of_memory();
+            c->size=size;
+            arena->mallocs++;
+            arena->mallocs_line++;
+        }
+        c->used=0;
+        c->next=arena->chunks;
+        arena->chunks=c;
     }
-    for (int i=0;i<3;++i)
-        if (command->redirects[i])
-            free(command->redirects[i]);
-    if (command->next)
-    {
-        free_command(command->next);
-        command->next=NULL;
+    void *p=c->data+c->used;
+    c->used+=n;
+    arena->used_line+=n;
+    return p;
+}
+char *arena_strndup(struct arena_t *arena, const char *s, size_t len)
+{
+    char *p=arena_alloc(arena, len+1);
+    memcpy(p, s, len);
+    p[len]=0;
+    return p;
+}
+char *arena_strdup(struct arena_t *arena, const char *s)
+{
+    return arena_strndup(arena, s, strlen(s));
+}
+/**
+ * Release everything allocated from the arena, keeping the largest chunk for reuse
+ */
+void arena_reset(struct arena_t *arena)
+{
+    struct arena_chunk *keep=arena->spare, *c=arena->chunks;
+    arena->spare=NULL;
+    while (c!=NULL) {
+        struct arena_chunk *next=c->next;
+        if (keep==NULL || c->size>keep->size) {
+            free(keep);
+            keep=c;
+        } else
+            free(c);
+        c=next;
     }
-    free(command->name);
-    free(command);
-    return 0;
+    if (keep!=NULL) {
+        keep->used=0;
+        keep->next=NULL;
+    }
+    arena->chunks=keep;
+    arena->mallocs_line=0;
+    arena->used_line=0;
+}
+/**
+ * Remember how much of the arena is in use, for arena_release()
+ */
+struct arena_mark arena_mark(struct arena_t *arena)
+{
+    struct arena_mark mark={arena->chunks, arena->chunks ? arena->chunks->used : 0};
+    return mark;
+}
+/**
+ * Release what was allocated since the mark, like popping a stack. The largest
+ * chunk that becomes free is kept as the spare, so a loop that allocates past
+ * the end of a chunk in every iteration does not call malloc() every time.
+ */
+void arena_release(struct arena_t *arena, struct arena_mark mark)
+{
+    while (arena->chunks!=mark.chunk) {
+        struct arena_chunk *c=arena->chunks;
+        arena->chunks=c->next;
+        if (arena->spare==NULL || c->size>arena->spare->size) {
+            free(arena->spare);
+            arena->spare=c;
+        } else
+            free(c);
+    }
+    if (mark.chunk!=NULL)
+        mark.chunk->used=mark.used;
+}
+/**
+ * Release all memory of an arena
+ */
+void arena_free(struct arena_t *arena)
+{
+    arena_reset(arena);
+    free(arena->chunks);
+    arena->chunks=NULL;
+}
+/*
+ * Growable byte buffer, doubling its capacity with realloc()
+ */
+struct strbuf {
+    char *s;
+    size_t len, cap;
+};
+void strbuf_reserve(struct strbuf *b, size_t n)
+{
+    if (b->len+n<=b->cap)
+        return;
+    size_t cap=b->cap ? b->cap : 256;
+    while (cap<b->len+n)
+        cap*=2;
+    char *s=realloc(b->s, cap);
+    if (s==NULL)
+        out_of_memory();
+    b->s=s;
+    b->cap=cap;
+}
+void strbuf_add(struct strbuf *b, char c)
+{
+    strbuf_reserve(b, 1);
+    b->s[b->len++]=c;
+}
+void strbuf_append(struct strbuf *b, const char *s, size_t n)
+{
+    strbuf_reserve(b, n);
+    memcpy(b->s+b->len, s, n);
+    b->len+=n;
+}
+/**
+ * Start a new, empty command in an arena
+ */
+struct command_t *command_new(struct arena_t *arena)
+{
+    struct command_t *command=arena_alloc(arena, sizeof(struct command_t));
+    memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+    command->arena=arena;
+    return command;
 }
+struct strbuf prompt_pending;  // lines of a command that is not complete yet
 /**
- * Show the command prompt
+ * Show the command prompt, or > while a command continues on the next line
  * @return [description]
  */
 int show_prompt()
 {
     char cwd[1024], hostname[1024];
+    if (prompt_pending.len>0) {
+        printf("> ");
+        return 0;
+    }
     gethostname(hostname, sizeof(hostname));
     getcwd(cwd, sizeof(cwd));
     printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
     return 0;
 }
+/*
+ * Parser: a small lexer splits the line into tokens and a recursive descent
+ * parser turns them into a tree that execute_node() walks:
+ *   list     := and_or ((';' | '&' | newline) and_or)* [';' | '&']
+ *   and_or   := pipeline (('&&' | '||') pipeline)*
+ *   pipeline := name '()' compound | compound | stage ('|' stage)*
+ *   stage    := '(' list ')' redirect* | compound redirect* | (word | redirect)+
+ *   compound := '{' list '}' | for name [in word*] do list done
+ *             | while list do list done | until list do list done
+ *             | if list then list (elif list then list)* [else list] fi
+ * Reserved words are only recognized where a command starts. A compound
+ * command that is not a stage becomes a node of its own, which is parsed once
+ * and then run as often as the loop or function it is in runs.
+ * Words keep their quotes and backslashes until they are stored in a command.
+ * Tokens are views into the line, which is scanned once: a word is copied only
+ * when it is stored, and a plain one, the usual case, is copied as it is.
+ */
+enum token_types {
+    TOKEN_END = 0,
+    TOKEN_WORD = 1,
+    TOKEN_REDIRECT = 2,     // operator with its fd, and the target for >&m
+    TOKEN_PIPE = 3,
+    TOKEN_AND = 4,
+    TOKEN_OR = 5,
+    TOKEN_SEMI = 6,
+    TOKEN_AMP = 7,
+    TOKEN_LPAREN = 8,
+    TOKEN_RPAREN = 9,
+    TOKEN_NEWLINE = 10,
+};
+struct parser_t {
+    char *p;            // next character of the line
+    struct arena_t *arena;
+    int type;           // current token
+    char *start;        // where it starts in the line: tokens are views, not copies
+    int len;            // and its length
+    bool plain;         // a word without quotes, backslashes, $, ` or pattern characters
+    bool error;
+    int nest;           // open compound commands, parentheses and operators waiting for their right side
+    bool more;          // the caller can read more lines when the input ends inside one of them
+    bool incomplete;    // and it did
+};
 /**
- * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
- * @return         0
+ * Find the end of a command substitution, $(...) or `...`, with nested ones and quotes
+ * @param  p at the $ or the opening backquote
+ * @return   just past the closing ) or backquote, the end of the string if there is none
  */
-int parse_command(char *buf, struct command_t *command)
+char *subst_skip(char *p)
 {
-    const char *splitters=" \t"; // split at whitespace
-    int index, len;
-    len=strlen(buf);
-    while (len>0 && strchr(splitters, buf[0])!=NULL) // trim left whitespace
-    {
-        buf++;
-        len--;
+    if (*p=='`') {
+        for (p++; *p!=0 && *p!='`'; p++)
+            if (*p=='\\' && p[1]!=0)
+                p++;
+        return *p!=0 ? p+1 : p;
     }
-    while (len>0 && strchr(splitters, buf[len-1])!=NULL)
-        buf[--len]=0; // trim right whitespace
-
-    if (len>0 && buf[len-1]=='?') // auto-complete
-        command->auto_complete=true;
-    if (len>0 && buf[len-1]=='&') // background
-        command->background=true;
-
-    char *pch = strtok(buf, splitters);
-    command->name=(char *)malloc(strlen(pch)+1);
-    if (pch==NULL)
-        command->name[0]=0;
-    else
-        strcpy(command->name, pch);
-
-    command->args=(char **)malloc(sizeof(char *));
-
-    int redirect_index;
-    int arg_index=0;
-    char temp_buf[1024], *arg;
-    while (1)
-    {
-        // tokenize input on splitters
-        pch = strtok(NULL, splitters);
-        if (!pch) break;
-        arg=temp_buf;
-        strcpy(arg, pch);
-        len=strlen(arg);
-
-        if (len==0) continue; // empty arg, go for next
-        while (len>0 && strchr(splitters, arg[0])!=NULL) // trim left whitespace
-        {
-            arg++;
-            len--;
-        }
-        while (len>0 && strchr(splitters, arg[len-1])!=NULL) arg[--len]=0; // trim right whitespace
-        if (len==0) continue; // empty arg, go for next
-
-        // piping to another command
-        if (strcmp(arg, "|")==0)
-        {
-            struct command_t *c=malloc(sizeof(struct command_t));
-            int l=strlen(pch);
-            pch[l]=splitters[0]; // restore strtok termination
-            index=1;
-            while (pch[index]==' ' || pch[index]=='\t') index++; // skip whitespaces
-
-            parse_command(pch+index, c);
-            pch[l]=0; // put back strtok termination
-            command->next=c;
-            continue;
-        }
-
-        // background process
-        if (strcmp(arg, "&")==0)
-            continue; // handled before
+    int depth=0;
+    for (p+=2; *p!=0; p++) {
+        if (*p=='\\' && p[1]!=0)
+            p++;
+        else if (*p=='\'') {
+            char *end=strchr(p+1, '\'');
+            if (end==NULL)
+                return p+strlen(p);
+            p=end;
+        } else if (*p=='"') {
+            for (p++; *p!=0 && *p!='"'; p++)
+                if (*p=='\\' && p[1]!=0)
+                    p++;
+                else if ((*p=='$' && p[1]=='(') || *p=='`')
+                    p=subst_skip(p)-1;
+            if (*p==0)
+                return p;
+        } else if ((*p=='$' && p[1]=='(') || *p=='`')
+            p=subst_skip(p)-1;
+        else if (*p=='(')
+            depth++;
+        else if (*p==')' && depth--==0)
+            return p+1;
+    }
+    return p;
+}
+enum lex_classes {
+    LEX_BREAK = 1,      // ends a word
+    LEX_SPECIAL = 2,    // makes a word need unquoting or expansion
+};
+const unsigned char lex_class[256]={
+    [0]=LEX_BREAK, [' ']=LEX_BREAK, ['\t']=LEX_BREAK, ['\n']=LEX_BREAK,
+    ['|']=LEX_BREAK, ['&']=LEX_BREAK, [';']=LEX_BREAK, ['(']=LEX_BREAK,
+    [')']=LEX_BREAK, ['<']=LEX_BREAK, ['>']=LEX_BREAK,
+    ['\\']=LEX_SPECIAL, ['\'']=LEX_SPECIAL, ['"']=LEX_SPECIAL, ['$']=LEX_SPECIAL,
+    ['`']=LEX_SPECIAL, ['*']=LEX_SPECIAL, ['?']=LEX_SPECIAL, ['[']=LEX_SPECIAL,
+};
+/**
+ * Move to the next token of the line
+ */
+void lex_next(struct parser_t *ps)
+{
+    char *p=ps->p;
+    while (*p==' ' || *p=='\t')
+        p++;
+    if (*p=='#')  // a comment runs to the end of the line
+        p+=strcspn(p, "\n");
+    ps->start=p;
 
-        // handle input redirection
-        redirect_index=-1;
-        if (arg[0]=='<')
-            redirect_index=0;
-        if (arg[0]=='>')
-        {
-            if (len>1 && arg[1]=='>')
-            {
-                redirect_index=2;
-                arg++;
-                len--;
+    int type;
+    if (*p==0)
+        type=TOKEN_END;
+    else if (*p=='\n')
+        type=TOKEN_NEWLINE, p++;
+    else if (p[0]=='|' && p[1]=='|')
+        type=TOKEN_OR, p+=2;
+    else if (p[0]=='&' && p[1]=='&')
+        type=TOKEN_AND, p+=2;
+    else if (p[0]=='|')
+        type=TOKEN_PIPE, p++;
+    else if (p[0]==';')
+        type=TOKEN_SEMI, p++;
+    else if (p[0]=='(')
+        type=TOKEN_LPAREN, p++;
+    else if (p[0]==')')
+        type=TOKEN_RPAREN, p++;
+    else if (p[0]=='&' && p[1]!='>')
+        type=TOKEN_AMP, p++;
+    else if (p[0]=='<' || p[0]=='>' || p[0]=='&' || (p[0]>='0' && p[0]<='9' && (p[1]=='<' || p[1]=='>'))) {
+        type=TOKEN_REDIRECT;
+        if (p[0]!='<' && p[0]!='>')  // fd number or the & of &>
+            p++;
+        if (strncmp(p, "<<<", 3)==0)
+            p+=3;
+        else if (strncmp(p, ">>", 2)==0 || strncmp(p, ">&", 2)==0 || strncmp(p, "<&", 2)==0)
+            p+=2;
+        else
+            p++;
+        if (p[-1]=='&')  // 2>&1 and >&- are one token
+            while ((*p>='0' && *p<='9') || *p=='-')
+                p++;
+    } else {
+        type=TOKEN_WORD;
+        ps->plain=true;
+        while (!(lex_class[(unsigned char)*p] & LEX_BREAK)) {
+            if (!(lex_class[(unsigned char)*p] & LEX_SPECIAL)) {
+                p++;
+                continue;
             }
-            else redirect_index=1;
-        }
-        if (redirect_index != -1)
-        {
-            command->redirects[redirect_index]=malloc(len);
-            strcpy(command->redirects[redirect_index], arg);
-            continue;
-        }
-
-        // normal arguments
-        if (len>2 && ((arg[0]=='"' && arg[len-1]=='"')
-                      || (arg[0]=='\'' && arg[len-1]=='\''))) // quote wrapped arg
-        {
-            arg[--len]=0;
-            arg++;
+            ps->plain=false;
+            if (*p=='\\' && p[1]!=0)
+                p+=2;
+            else if (*p=='\'') {
+                char *end=strchr(p+1, '\'');
+                p=end ? end+1 : p+strlen(p);
+            } else if (*p=='"') {
+                for (p++; *p!=0 && *p!='"'; p++)
+                    if (*p=='\\' && p[1]!=0)
+                        p++;
+                    else if ((*p=='$' && p[1]=='(') || *p=='`')
+                        p=subst_skip(p)-1;
+                if (*p!=0)
+                    p++;
+            } else if ((*p=='$' && p[1]=='(') || *p=='`')
+                p=subst_skip(p);  // the parentheses and blanks inside belong to the word
+            else
+                p++;
         }
-        command->args=(char **)realloc(command->args, sizeof(char *)*(arg_index+1));
-        command->args[arg_index]=(char *)malloc(len+1);
-        strcpy(command->args[arg_index++], arg);
     }
-    command->arg_count=arg_index;
-    return 0;
+    ps->type=type;
+    ps->len=p-ps->start;
+    ps->p=p;
 }
-void prompt_backspace()
+void syntax_error(struct parser_t *ps)
 {
-    putchar(8); // go back 1
-    putchar(' '); // write empty over
-    putchar(8); // go back 1 again
+    if (ps->error)
+        return;
+    ps->error=true;
+    if (ps->type==TOKEN_END && ps->nest>0) {  // the line stops in the middle of a command
+        ps->incomplete=true;
+        if (!ps->more)
+            fprintf(stderr, "-%s: syntax error: unexpected end of file\n", sysname);
+        return;
+    }
+    if (ps->type==TOKEN_END || ps->type==TOKEN_NEWLINE)
+        fprintf(stderr, "-%s: syntax error near unexpected token `newline'\n", sysname);
+    else
+        fprintf(stderr, "-%s: syntax error near unexpected token `%.*s'\n", sysname, ps->len, ps->start);
+}
+void skip_newlines(struct parser_t *ps)
+{
+    while (ps->type==TOKEN_NEWLINE)
+        lex_next(ps);
 }
 /**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
+ * Tell whether the current token is the reserved word
  */
-int prompt(struct command_t *command)
+bool is_keyword(struct parser_t *ps, const char *word)
 {
-    int index=0;
-    char c;
-    char buf[4096];
-    static char oldbuf[4096];
-
-    // tcgetattr gets the parameters of the current terminal
-    // STDIN_FILENO will tell tcgetattr that it should write the settings
-    // of stdin to oldt
-    static struct termios backup_termios, new_termios;
-    tcgetattr(STDIN_FILENO, &backup_termios);
-    new_termios = backup_termios;
-    // ICANON normally takes care that one line at a time will be processed
-    // that means it will return if it sees a "\n" or an EOF or an EOL
-    new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
-    // Those new settings will be set to STDIN
-    // TCSANOW tells tcsetattr to change attributes immediately.
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
-
-
-    //FIXME: backspace is applied before printing chars
-    show_prompt();
-    int multicode_state=0;
-    buf[0]=0;
-    while (1)
-    {
-        c=getchar();
-        // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
-        if (c==32 && index==0)
-            continue;
-        
-        if (c==9) // handle tab
-        {
-            buf[index++]='?'; // autocomplete
-            break;
-        }
-
-        if (c==127) // handle backspace
-        {
-            if (index>0)
-            {
-                prompt_backspace();
-                index--;
-            }
-            continue;
-        }
-        if (c==27 && multicode_state==0) // handle multi-code keys
-        {
-            multicode_state=1;
-            continue;
-        }
-        if (c==91 && multicode_state==1)
-        {
-            multicode_state=2;
-            continue;
-        }
-        if (c==65 && multicode_state==2) // up arrow
-        {
-            int i;
-            while (index>0)
-            {
-                prompt_backspace();
-                index--;
+    return ps->type==TOKEN_WORD && ps->len==(int)strlen(word) && memcmp(ps->start, word, ps->len)==0;
+}
+/**
+ * Consume a reserved word that must come next
+ * @return false after a syntax error
+ */
+bool expect_keyword(struct parser_t *ps, const char *word)
+{
+    if (!is_keyword(ps, word)) {
+        syntax_error(ps);
+        return false;
+    }
+    lex_next(ps);
+    return true;
+}
+/**
+ * Tell whether a character may be part of a variable name
+ */
+bool name_char(char c, bool first)
+{
+    return (c>='a' && c<='z') || (c>='A' && c<='Z') || c=='_' || (!first && c>='0' && c<='9');
+}
+/**
+ * Tell whether p starts a parameter expansion: $name, ${...}, $1, $#, $?, $$, $@, $*
+ * or an arithmetic expansion $((...))
+ */
+bool param_start(const char *p)
+{
+    return p[0]=='$' && p[1]!=0 && (name_char(p[1], false) || strchr("{#?$@*", p[1])!=NULL
+                                    || (p[1]=='(' && p[2]=='('));
+}
+/**
+ * Tell whether a word has a substitution or a parameter outside single quotes,
+ * which makes it expand when the command runs
+ * @param  len length of the word, which need not be NUL terminated
+ */
+bool word_has_expansion(const char *word, int len)
+{
+    const char *end=word+len;
+    for (const char *p=word; p<end; p++) {
+        if (*p=='\\' && p+1<end)
+            p++;
+        else if (*p=='\'') {
+            p=memchr(p+1, '\'', end-p-1);
+            if (p==NULL)
+                return false;
+        } else if (p+1<end && ((*p=='$' && p[1]=='(') || param_start(p)))
+            return true;
+        else if (*p=='`')
+            return true;
+    }
+    return false;
+}
+/**
+ * Tell whether a word has a *, ? or [ outside quotes, which makes it a glob pattern
+ * @param  len length of the word, which need not be NUL terminated
+ */
+bool word_has_glob(const char *word, int len)
+{
+    const char *end=word+len;
+    for (const char *p=word; p<end; p++) {
+        if (*p=='\\' && p+1<end)
+            p++;
+        else if (*p=='\'' || *p=='"') {
+            p=memchr(p+1, *p, end-p-1);
+            if (p==NULL)
+                return false;
+        } else if (*p=='*' || *p=='?' || *p=='[')
+            return true;
+    }
+    return false;
+}
+/**
+ * Remove the quotes and backslashes of a word
+ * @param  len     length of the word, which need not be NUL terminated
+ * @param  pattern keep quoted pattern characters escaped with a backslash, for fnmatch()
+ * @return         the plain word, allocated in the arena
+ */
+char *word_unquote(struct arena_t *arena, const char *word, int len, bool pattern)
+{
+    char *out=arena_alloc(arena, pattern ? len*2+1 : len+1), *o=out;
+    const char *special=pattern ? "*?[]\\" : "";
+    const char *end=word+len;
+    for (const char *p=word; p<end; p++) {
+        if (*p=='\\' && p+1<end) {
+            if (*special && strchr(special, p[1])!=NULL)
+                *o++='\\';
+            *o++=*++p;
+        } else if (*p=='\'') {
+            while (++p<end && *p!='\'') {
+                if (*special && strchr(special, *p)!=NULL)
+                    *o++='\\';
+                *o++=*p;
             }
-            for (i=0;oldbuf[i];++i)
-            {
-                putchar(oldbuf[i]);
-                buf[i]=oldbuf[i];
+            if (p==end)
+                break;
+        } else if (*p=='"') {
+            while (++p<end && *p!='"') {
+                if (*p=='\\' && p+1<end && strchr("\"\\$`", p[1])!=NULL)
+                    p++;
+                if (*special && strchr(special, *p)!=NULL)
+                    *o++='\\';
+                *o++=*p;
             }
-            index=i;
-            continue;
-        }
-        else
-            multicode_state=0;
-
-        putchar(c); // echo the character
-        buf[index++]=c;
-        if (index>=sizeof(buf)-1) break;
-        if (c=='\n') // enter key
-            break;
-        if (c==4) // Ctrl+D
-            return EXIT;
+            if (p==end)
+                break;
+        } else
+            *o++=*p;
     }
-    if (index>0 && buf[index-1]=='\n') // trim newline from the end
-        index--;
-    buf[index++]=0; // null terminate string
-
-    strcpy(oldbuf, buf);
-
-    if(strlen(buf)>0)    // to handle enter dump error
-        parse_command(buf, command);
-
-     //print_command(command); // DEBUG: uncomment for debugging
-
-    // restore the old settings
-    tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
-    return SUCCESS;
+    *o=0;
+    return out;
 }
-int process_command(struct command_t *command);
-int main()
+/**
+ * Recognize a redirection operator and append it to the command: [n]<, [n]>,
+ * [n]>>, [n]>&m, [n]<&m, [n]<<<, &> and &>>. The target of a duplication is part
+ * of the operator, the others are left NULL for the next word.
+ * @param  len length of the operator, the token that follows is not part of it
+ * @return the redirection, NULL if the word is not one
+ */
+struct redirect_t *parse_redirect(struct command_t *command, const char *word, int len)
 {
-
-    // for custom command history initialization performed below
-    for(int i=0;i<HISTORY_SIZE;i++) {
-        history[i]=malloc(100 * sizeof(char));
+    int fd=-1, type;
+    bool both=false;  // &> sends stdout and stderr to the file
+    const char *p=word;
+    if (p[0]>='0' && p[0]<='9' && (p[1]=='<' || p[1]=='>'))
+        fd=*p++-'0';
+    else if (p[0]=='&' && p[1]=='>') {
+        both=true;
+        p++;
     }
+    if (strncmp(p, "<<<", 3)==0)
+        type=REDIRECT_STRING;
+    else if (strncmp(p, ">>", 2)==0)
+        type=REDIRECT_APPEND;
+    else if (strncmp(p, ">&", 2)==0 || strncmp(p, "<&", 2)==0)
+        type=REDIRECT_DUP;
+    else if (p[0]=='>')
+        type=REDIRECT_OUT;
+    else if (p[0]=='<')
+        type=REDIRECT_IN;
+    else
+        return NULL;
+    if (both && type!=REDIRECT_OUT && type!=REDIRECT_APPEND)
+        return NULL;
+    if (fd==-1)
+        fd=p[0]=='<' ? 0 : 1;
+    p+=type==REDIRECT_STRING ? 3 : type==REDIRECT_OUT || type==REDIRECT_IN ? 1 : 2;
 
-    while (1)
-    {
-        struct command_t *command=malloc(sizeof(struct command_t));
-        memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
-
-        int code;
-        code = prompt(command);
-        if (code==EXIT) break;
-
-        if(command->name!=NULL)
-            code = process_command(command);
-        if (code==EXIT) break;
-
-        free_command(command);
+    struct redirect_t *r=arena_alloc(command->arena, sizeof(struct redirect_t)), **tail;
+    r->fd=fd;
+    r->type=type;
+    r->target=p<word+len ? arena_strndup(command->arena, p, word+len-p) : NULL;
+    r->raw=false;
+    r->next=NULL;
+    for (tail=&command->redirects; *tail!=NULL; tail=&(*tail)->next);
+    *tail=r;
+    if (both) {  // same as >file 2>&1
+        struct redirect_t *err=arena_alloc(command->arena, sizeof(struct redirect_t));
+        err->fd=2;
+        err->type=REDIRECT_DUP;
+        err->target=arena_strdup(command->arena, "1");
+        err->raw=false;
+        err->next=NULL;
+        r->next=err;
     }
-
-    printf("\n");
-    return 0;
+    return r;
 }
-
-int process_command(struct command_t *command)
+/**
+ * Parse the redirection at the current token, with its target word
+ * @return 0, or -1 on a syntax error
+ */
+int parse_redirect_token(struct parser_t *ps, struct command_t *command)
 {
-    int r;
-    if (strcmp(command->name, "")==0) return SUCCESS;
-
-    if (strcmp(command->name, "exit")==0)
-        return EXIT;
-
-
-    if (command->args[0]!=NULL) {
-        if (command->args[1]!=NULL) {   // store the command with two parameters
-            strcpy(history[curind], command->name);
-            strcat(history[curind]," ");
-            strcat(history[curind],command->args[0]);
-            strcat(history[curind]," ");
-            strcat(history[curind],command->args[1]);
+    struct redirect_t *r=parse_redirect(command, ps->start, ps->len);
+    if (r==NULL) {
+        syntax_error(ps);
+        return -1;
+    }
+    lex_next(ps);
+    if (r->target==NULL) {
+        if (ps->type!=TOKEN_WORD) {
+            syntax_error(ps);
+            return -1;
         }
-        else {  // store the command with one parameter
-            strcpy(history[curind], command->name);
-            strcat(history[curind]," ");
-            strcat(history[curind],command->args[0]);
+        r->raw=word_has_expansion(ps->start, ps->len);
+        r->target=r->raw ? arena_strndup(ps->arena, ps->start, ps->len)
+                  : word_unquote(ps->arena, ps->start, ps->len, false);
+        lex_next(ps);
+    }
+    return 0;
+}
+/**
+ * Length of the variable name at the start of s, 0 if there is none
+ */
+int name_length(const char *s)
+{
+    int len=0;
+    if (name_char(s[0], true))
+        while (name_char(s[len], false))
+            len++;
+    return len;
+}
+/**
+ * Tell whether a word is an assignment, name=value
+ */
+bool word_is_assignment(const char *word)
+{
+    int len=name_length(word);
+    return len>0 && word[len]=='=';
+}
+/**
+ * Store a word as the command's name or as its next argument. This is where the
+ * word is copied out of the line, once: unquoted, or as typed if it expands later.
+ * @param text     the word as typed and its length
+ * @param plain    the lexer found nothing to unquote or expand in it
+ * @param args_cap capacity of command->args, which grows by doubling inside the arena
+ */
+void command_add_word(struct command_t *command, const char *text, int len, bool plain, int *args_cap)
+{
+    int expand=plain ? EXPAND_NONE : word_has_expansion(text, len) ? EXPAND_RAW
+               : command->name!=NULL && word_has_glob(text, len) ? EXPAND_GLOB : EXPAND_NONE;
+    char *word=plain || expand==EXPAND_RAW ? arena_strndup(command->arena, text, len)
+               : word_unquote(command->arena, text, len, expand==EXPAND_GLOB);
+    int arg_index=command->arg_count;
+    if (command->name==NULL) {
+        command->name=word;
+        command->name_raw=expand==EXPAND_RAW;
+        return;
+    }
+    if (arg_index+2>*args_cap) {
+        char **args=arena_alloc(command->arena, sizeof(char *)**args_cap*2);
+        memcpy(args, command->args, sizeof(char *)**args_cap);
+        command->args=args;
+        if (command->expand!=NULL) {
+            char *flags=arena_alloc(command->arena, *args_cap*2);
+            memcpy(flags, command->expand, *args_cap);
+            command->expand=flags;
         }
+        *args_cap*=2;
     }
-    else // store the command without parameter
-        strcpy(history[curind],command->name);
-
-    if (histflag == 0 && curind==HISTORY_SIZE-1)  // history is kept in the same array with cyclic array
-        histflag=1;
-    curind=(curind+1)%HISTORY_SIZE;
-
+    if (expand!=EXPAND_NONE && command->expand==NULL) {  // only lines with patterns pay for the flags
+        command->expand=arena_alloc(command->arena, *args_cap);
+        memset(command->expand, EXPAND_NONE, *args_cap);
+    }
+    if (command->expand!=NULL)
+        command->expand[arg_index]=expand;
+    command->args[arg_index++]=word;
+    command->args[arg_index]=NULL; // keep args NULL terminated
+    command->arg_count=arg_index;
+}
+/**
+ * Parse a simple command: its assignments, name, arguments and redirections
+ * @param  ps      parser at the first word or redirection
+ * @param  command [description]
+ * @return         0, or -1 on a syntax error
+ */
+int parse_command(struct parser_t *ps, struct command_t *command)
+{
+    int args_cap=8, assigns_cap=0;
+    command->args=arena_alloc(command->arena, sizeof(char *)*args_cap);
+    command->args[0]=NULL;
 
-    if (strcmp(command->name, "cd")==0)
+    while (ps->type==TOKEN_WORD || ps->type==TOKEN_REDIRECT)
     {
-        if (command->arg_count > 0)
-        {
-            r=chdir(command->args[0]);
-            if (r==-1)
-                printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-            return SUCCESS;
+        if (ps->type==TOKEN_REDIRECT) {
+            if (parse_redirect_token(ps, command)==-1)
+                return -1;
+            continue;
         }
+        if (command->name==NULL && word_is_assignment(ps->start)) {  // kept as typed, expanded when it runs
+            if (command->assign_count==assigns_cap) {
+                assigns_cap=assigns_cap ? assigns_cap*2 : 4;
+                char **assigns=arena_alloc(command->arena, sizeof(char *)*assigns_cap);
+                if (command->assign_count>0)
+                    memcpy(assigns, command->assigns, sizeof(char *)*command->assign_count);
+                command->assigns=assigns;
+            }
+            command->assigns[command->assign_count++]=arena_strndup(command->arena, ps->start, ps->len);
+        } else
+            command_add_word(command, ps->start, ps->len, ps->plain, &args_cap);
+        lex_next(ps);
+    }
+    if (command->name==NULL)  // only redirections or assignments
+        command->name=arena_strdup(command->arena, "");
+    return 0;
+}
+struct node_t *node_new(struct arena_t *arena, int type, struct node_t *left, struct node_t *right)
+{
+    struct node_t *node=arena_alloc(arena, sizeof(struct node_t));
+    node->type=type;
+    node->command=NULL;
+    node->left=left;
+    node->right=right;
+    node->body=NULL;
+    node->text=NULL;
+    return node;
+}
+/**
+ * Make a list run as a background job: a pipeline is simply marked, anything
+ * else becomes a subshell stage of its own
+ * @param  text how the list was written, for the job table
+ */
+struct node_t *node_background(struct arena_t *arena, struct node_t *list, const char *text, int len)
+{
+    if (list->type==NODE_PIPELINE) {
+        list->command->background=true;
+        return list;
+    }
+    struct command_t *command=command_new(arena);
+    while (len>0 && (text[len-1]==' ' || text[len-1]=='\t'))
+        len--;
+    command->name=arena_strndup(arena, text, len);
+    command->args=arena_alloc(arena, sizeof(char *));
+    command->args[0]=NULL;
+    command->subshell=list;
+    command->background=true;
+    struct node_t *node=node_new(arena, NODE_PIPELINE, NULL, NULL);
+    node->command=command;
+    return node;
+}
+struct node_t *parse_list(struct parser_t *ps);
+/**
+ * Tell whether the current token starts a compound command
+ */
+bool is_compound(struct parser_t *ps)
+{
+    return is_keyword(ps, "{") || is_keyword(ps, "for") || is_keyword(ps, "while")
+           || is_keyword(ps, "until") || is_keyword(ps, "if");
+}
+/**
+ * Tell whether the current token is a reserved word that ends a list
+ */
+bool is_list_end(struct parser_t *ps)
+{
+    static const char *ends[]={"}", "do", "done", "then", "elif", "else", "fi", NULL};
+    if (ps->type!=TOKEN_WORD)
+        return false;
+    for (int i=0; ends[i]!=NULL; i++)
+        if (is_keyword(ps, ends[i]))
+            return true;
+    return false;
+}
+/**
+ * Parse the list of a compound command, up to its next reserved word
+ * @return the list, NULL on a syntax error; an empty list is one
+ */
+struct node_t *parse_clause(struct parser_t *ps)
+{
+    struct node_t *list=parse_list(ps);
+    if (list==NULL)
+        syntax_error(ps);
+    return list;
+}
+/**
+ * Parse if or elif up to the fi that closes it
+ */
+struct node_t *parse_if(struct parser_t *ps)
+{
+    lex_next(ps);
+    struct node_t *node=node_new(ps->arena, NODE_IF, parse_clause(ps), NULL);
+    if (node->left==NULL || !expect_keyword(ps, "then") || (node->body=parse_clause(ps))==NULL)
+        return NULL;
+    if (is_keyword(ps, "elif"))
+        return (node->right=parse_if(ps))!=NULL ? node : NULL;
+    if (is_keyword(ps, "else")) {
+        lex_next(ps);
+        if ((node->right=parse_clause(ps))==NULL)
+            return NULL;
+    }
+    return expect_keyword(ps, "fi") ? node : NULL;
+}
+/**
+ * Parse for name [in word...]; do list; done. The words are kept in a command,
+ * so they expand like arguments each time the loop starts.
+ */
+struct node_t *parse_for(struct parser_t *ps)
+{
+    struct node_t *node=node_new(ps->arena, NODE_FOR, NULL, NULL);
+    struct command_t *words=command_new(ps->arena);
+    int args_cap=8;
+    words->args=arena_alloc(ps->arena, sizeof(char *)*args_cap);
+    words->args[0]=NULL;
+    node->command=words;
+    lex_next(ps);
+    if (ps->type!=TOKEN_WORD || name_length(ps->start)==0 || name_length(ps->start)!=ps->len) {
+        syntax_error(ps);
+        return NULL;
+    }
+    command_add_word(words, ps->start, ps->len, ps->plain, &args_cap);
+    lex_next(ps);
+    skip_newlines(ps);
+    if (is_keyword(ps, "in")) {
+        for (lex_next(ps); ps->type==TOKEN_WORD; lex_next(ps))
+            command_add_word(words, ps->start, ps->len, ps->plain, &args_cap);
+    } else  // without in, the loop goes over the parameters
+        command_add_word(words, "\"$@\"", 4, false, &args_cap);
+    if (ps->type==TOKEN_SEMI || ps->type==TOKEN_NEWLINE)
+        lex_next(ps);
+    else if (!is_keyword(ps, "do")) {
+        syntax_error(ps);
+        return NULL;
+    }
+    skip_newlines(ps);
+    if (!expect_keyword(ps, "do") || (node->body=parse_clause(ps))==NULL || !expect_keyword(ps, "done"))
+        return NULL;
+    return node;
+}
+/**
+ * Parse a compound command: { list }, for, while, until or if
+ * @return its node, NULL on a syntax error
+ */
+struct node_t *parse_compound(struct parser_t *ps)
+{
+    struct node_t *node=NULL;
+    ps->nest++;
+    if (is_keyword(ps, "{")) {
+        lex_next(ps);
+        node=parse_clause(ps);  // a group is just its list
+        if (node!=NULL && !expect_keyword(ps, "}"))
+            node=NULL;
+    } else if (is_keyword(ps, "for"))
+        node=parse_for(ps);
+    else if (is_keyword(ps, "if"))
+        node=parse_if(ps);
+    else {
+        node=node_new(ps->arena, is_keyword(ps, "while") ? NODE_WHILE : NODE_UNTIL, NULL, NULL);
+        lex_next(ps);
+        if ((node->left=parse_clause(ps))==NULL || !expect_keyword(ps, "do")
+            || (node->body=parse_clause(ps))==NULL || !expect_keyword(ps, "done"))
+            node=NULL;
+    }
+    ps->nest--;
+    return node;
+}
+/**
+ * Make a pipeline stage of a ( list ) or of a compound command that is piped or
+ * redirected: it runs in a forked copy of the shell
+ * @param  open where it starts in the line, end where it ends
+ */
+struct command_t *stage_wrap(struct parser_t *ps, struct node_t *list, char *open, char *end)
+{
+    struct command_t *command=command_new(ps->arena);
+    while (end>open && (end[-1]==' ' || end[-1]=='\t' || end[-1]=='\n'))
+        end--;
+    command->subshell=list;
+    command->name=arena_strndup(ps->arena, open, end-open);  // shown as typed
+    command->args=arena_alloc(ps->arena, sizeof(char *));
+    command->args[0]=NULL;
+    while (ps->type==TOKEN_REDIRECT)
+        if (parse_redirect_token(ps, command)==-1)
+            return NULL;
+    return command;
+}
+/**
+ * Parse one stage of a pipeline, a simple command, a ( list ) subshell or a compound command
+ * @return the stage, NULL on a syntax error
+ */
+struct command_t *parse_stage(struct parser_t *ps)
+{
+    char *open=ps->start;
+    if (ps->type==TOKEN_LPAREN) {
+        lex_next(ps);
+        ps->nest++;
+        struct node_t *list=parse_list(ps);
+        ps->nest--;
+        if (ps->error)
+            return NULL;
+        if (ps->type!=TOKEN_RPAREN || list==NULL) {
+            syntax_error(ps);
+            return NULL;
+        }
+        char *end=ps->p;
+        lex_next(ps);
+        return stage_wrap(ps, list, open, end);
+    }
+    if (is_compound(ps)) {
+        struct node_t *node=parse_compound(ps);
+        return node!=NULL ? stage_wrap(ps, node, open, ps->start) : NULL;
+    }
+    if (ps->type!=TOKEN_WORD && ps->type!=TOKEN_REDIRECT) {
+        syntax_error(ps);
+        return NULL;
+    }
+    struct command_t *command=command_new(ps->arena);
+    if (parse_command(ps, command)==-1)
+        return NULL;
+    return command;
+}
+/**
+ * Tell whether the current token starts a function definition, name () or function name
+ */
+bool is_function(struct parser_t *ps)
+{
+    if (is_keyword(ps, "function"))
+        return true;
+    if (ps->type!=TOKEN_WORD)
+        return false;
+    for (int i=0; i<ps->len; i++)
+        if (strchr("'\"\\$`=*?[", ps->start[i])!=NULL)
+            return false;
+    const char *p=ps->p;
+    while (*p==' ' || *p=='\t')
+        p++;
+    if (*p++!='(')
+        return false;
+    while (*p==' ' || *p=='\t')
+        p++;
+    return *p==')';
+}
+/**
+ * Parse a function definition. Its body is only checked here and kept as typed:
+ * it is parsed again into the function's own arena when the definition runs,
+ * because the line's arena does not live as long as the function.
+ */
+struct node_t *parse_function(struct parser_t *ps)
+{
+    struct node_t *node=node_new(ps->arena, NODE_FUNCTION, NULL, NULL);
+    bool keyword=is_keyword(ps, "function");
+    if (keyword)
+        lex_next(ps);
+    if (ps->type!=TOKEN_WORD) {
+        syntax_error(ps);
+        return NULL;
+    }
+    node->command=command_new(ps->arena);
+    node->command->name=arena_strndup(ps->arena, ps->start, ps->len);
+    node->command->args=arena_alloc(ps->arena, sizeof(char *));
+    node->command->args[0]=NULL;
+    lex_next(ps);
+    if (ps->type==TOKEN_LPAREN || !keyword) {
+        if (ps->type==TOKEN_LPAREN)
+            lex_next(ps);
+        if (ps->type!=TOKEN_RPAREN) {
+            syntax_error(ps);
+            return NULL;
+        }
+        lex_next(ps);
+    }
+    ps->nest++;
+    skip_newlines(ps);
+    char *open=ps->start;
+    if (!is_compound(ps)) {
+        syntax_error(ps);
+        return NULL;
+    }
+    if (parse_compound(ps)==NULL)
+        return NULL;
+    ps->nest--;
+    char *end=ps->start;
+    while (end>open && (end[-1]==' ' || end[-1]=='\t' || end[-1]=='\n'))
+        end--;
+    node->text=arena_strndup(ps->arena, open, end-open);
+    return node;
+}
+struct node_t *parse_pipeline(struct parser_t *ps)
+{
+    bool timed=false;
+    if (is_function(ps))
+        return parse_function(ps);
+    if (is_keyword(ps, "time")) {
+        timed=true;
+        lex_next(ps);
+    }
+    struct command_t *first, *last;
+    if (!timed && is_compound(ps)) {  // not a stage unless it is piped or redirected
+        char *open=ps->start;
+        struct node_t *node=parse_compound(ps);
+        if (node==NULL || (ps->type!=TOKEN_PIPE && ps->type!=TOKEN_REDIRECT))
+            return node;
+        first=stage_wrap(ps, node, open, ps->start);
+    } else if (timed && ps->type!=TOKEN_WORD && ps->type!=TOKEN_REDIRECT && ps->type!=TOKEN_LPAREN) {
+        first=command_new(ps->arena);  // time on its own times nothing
+        first->name=arena_strdup(ps->arena, "");
+    } else
+        first=parse_stage(ps);
+    last=first;
+    if (first==NULL)
+        return NULL;
+    first->timed=timed;
+    while (ps->type==TOKEN_PIPE) {
+        lex_next(ps);
+        ps->nest++;
+        skip_newlines(ps);
+        last->next=parse_stage(ps);
+        ps->nest--;
+        if (last->next==NULL)
+            return NULL;
+        last=last->next;
+    }
+    struct node_t *node=node_new(ps->arena, NODE_PIPELINE, NULL, NULL);
+    node->command=first;
+    return node;
+}
+struct node_t *parse_and_or(struct parser_t *ps)
+{
+    struct node_t *left=parse_pipeline(ps);
+    while (left!=NULL && (ps->type==TOKEN_AND || ps->type==TOKEN_OR)) {
+        int type=ps->type==TOKEN_AND ? NODE_AND : NODE_OR;
+        lex_next(ps);
+        ps->nest++;
+        skip_newlines(ps);
+        struct node_t *right=parse_pipeline(ps);
+        ps->nest--;
+        left=right ? node_new(ps->arena, type, left, right) : NULL;
+    }
+    return left;
+}
+/**
+ * Parse and-or lists separated by ;, & or newlines, up to the end of the line,
+ * a ')' or a reserved word that closes a compound command
+ * @return the tree, NULL for an empty list or a syntax error
+ */
+struct node_t *parse_list(struct parser_t *ps)
+{
+    struct node_t *list=NULL;
+    skip_newlines(ps);
+    while (ps->type!=TOKEN_END && ps->type!=TOKEN_RPAREN && !is_list_end(ps)) {
+        char *from=ps->start;
+        struct node_t *item=parse_and_or(ps);
+        if (item==NULL)
+            return NULL;
+        if (ps->type==TOKEN_AMP)
+            item=node_background(ps->arena, item, from, ps->start-from);
+        if (ps->type==TOKEN_AMP || ps->type==TOKEN_SEMI || ps->type==TOKEN_NEWLINE)
+            lex_next(ps);
+        else if (ps->type!=TOKEN_END && ps->type!=TOKEN_RPAREN && !is_list_end(ps)) {
+            syntax_error(ps);
+            return NULL;
+        }
+        list=list ? node_new(ps->arena, NODE_SEQ, list, item) : item;
+        skip_newlines(ps);
+    }
+    return list;
+}
+/**
+ * Parse a command line into a tree allocated in the arena
+ * @param  incomplete set when the input ends inside a compound command or after
+ *                    an operator, and more lines should be appended before parsing
+ *                    again; NULL if there are no more lines, that is a syntax error
+ * @return the tree, NULL for an empty line or a syntax error (last_status is 2 then)
+ */
+struct node_t *parse_line(char *buf, struct arena_t *arena, bool *incomplete)
+{
+    struct parser_t ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.p=buf;
+    ps.arena=arena;
+    ps.more=incomplete!=NULL;
+    lex_next(&ps);
+    struct node_t *tree=parse_list(&ps);
+    if (!ps.error && ps.type!=TOKEN_END)  // a ')' without its '(', or a done without its loop
+        syntax_error(&ps);
+    if (incomplete!=NULL)
+        *incomplete=ps.incomplete;
+    if (ps.error) {
+        if (!ps.incomplete || incomplete==NULL)
+            last_status=2;
+        return NULL;
     }
-    if (strcmp(command->name, "myjobs")==0) {  // lists the user's processes
 
-        char cmd[100];
-        strcpy(cmd,"ps -fU ");
-        strcat(cmd,getenv("USER"));
-        strcat(cmd," -eo pid,cmd,stat");
-        system(cmd);
-        return SUCCESS;
+    int len=strlen(buf);
+    while (len>0 && (buf[len-1]==' ' || buf[len-1]=='\t'))
+        len--;
+    struct command_t *last=tree!=NULL ? line_last(tree) : NULL;
+    if (last!=NULL && len>0 && buf[len-1]=='?' && (len<2 || buf[len-2]!='$')) // auto-complete the last command, $? is a parameter
+        last->auto_complete=true;
+    return tree;
+}
+/**
+ * The pipeline at the end of a line, where Tab completion happens
+ * @return its first stage, NULL if the line ends with a compound command
+ */
+struct command_t *line_last(struct node_t *tree)
+{
+    while (tree->type==NODE_SEQ || tree->type==NODE_AND || tree->type==NODE_OR)
+        tree=tree->right;
+    return tree->type==NODE_PIPELINE ? tree->command : NULL;
+}
+void prompt_backspace()
+{
+    putchar(8); // go back 1
+    putchar(' '); // write empty over
+    putchar(8); // go back 1 again
+}
+/*
+ * Prompt input: while a line is typed the shell waits in epoll_wait() on the
+ * terminal, a signalfd and the alarm timerfd. SIGCHLD, SIGINT and SIGTSTP are
+ * blocked only for that wait, so they arrive through the signalfd instead of
+ * interrupting the line editor. Background jobs that finish are reported at once
+ * and the line being typed is drawn again under the report. Keys are read from
+ * the terminal in batches: a paste costs one read(), not one per character.
+ */
+#define PROMPT_INPUT_BLOCK 4096  // the size of the terminal's input queue
+#define PROMPT_INTERRUPT 3  // returned for ^C, ISIG turns the key itself into SIGINT
+
+int events_fd=-1;           // epoll instance, -1 to block in read() instead
+int events_signal_fd=-1;
+int events_alarm_fd=-1;     // alarm_fd once it is registered, alarms create it lazily
+sigset_t events_signals;
+struct {
+    unsigned char buf[PROMPT_INPUT_BLOCK];
+    int pos, len;
+} prompt_input;
+
+void signal_noop(int sig)
+{
+}
+void signal_interrupt(int sig)
+{
+    interrupted=1;
+}
+/**
+ * Set up the event loop of the interactive prompt
+ */
+void events_init()
+{
+    struct epoll_event ev={.events=EPOLLIN};
+    sigemptyset(&events_signals);
+    sigaddset(&events_signals, SIGCHLD);
+    sigaddset(&events_signals, SIGINT);
+    sigaddset(&events_signals, SIGTSTP);
+    events_fd=epoll_create1(EPOLL_CLOEXEC);
+    events_signal_fd=signalfd(-1, &events_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    ev.data.fd=STDIN_FILENO;
+    if (events_fd==-1 || events_signal_fd==-1 || epoll_ctl(events_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev)==-1)
+        goto fail;
+    ev.data.fd=events_signal_fd;
+    if (epoll_ctl(events_fd, EPOLL_CTL_ADD, events_signal_fd, &ev)==-1)
+        goto fail;
+    return;
+fail:
+    if (events_fd!=-1)
+        close(events_fd);
+    if (events_signal_fd!=-1)
+        close(events_signal_fd);
+    events_fd=events_signal_fd=-1;
+}
+/**
+ * Clear the line being typed, so that a report can be printed in its place
+ */
+void prompt_clear()
+{
+    printf("\r\033[K");
+}
+/**
+ * Draw the prompt again with what has been typed so far, after prompt_clear()
+ */
+void prompt_redraw(const char *buf, int index)
+{
+    show_prompt();
+    printf("%.*s", index, buf);
+    fflush(stdout);
+}
+/**
+ * Handle the signals queued on the signalfd
+ * @return PROMPT_INTERRUPT if ^C was pressed, 0 otherwise
+ */
+int prompt_signals(const char *buf, int index)
+{
+    struct signalfd_siginfo si;
+    int result=0;
+    while (read(events_signal_fd, &si, sizeof(si))==sizeof(si))
+        if (si.ssi_signo==SIGINT)
+            result=PROMPT_INTERRUPT;
+        else if (si.ssi_signo==SIGCHLD)
+            job_reap();
+        // SIGTSTP: ^Z at the prompt has nothing to stop
+    if (result==0 && job_notify_pending()) {
+        prompt_clear();
+        job_notify();
+        prompt_redraw(buf, index);
+    }
+    return result;
+}
+/**
+ * Read one key for the prompt. Alarms that go off and jobs that finish while
+ * waiting are reported and the prompt is drawn again with what has been typed so far.
+ * @param  buf   line typed so far
+ * @param  index its length
+ * @return       the key, PROMPT_INTERRUPT for ^C or EOF
+ */
+int prompt_getchar(const char *buf, int index)
+{
+    if (prompt_input.pos<prompt_input.len)
+        return prompt_input.buf[prompt_input.pos++];
+    fflush(stdout);
+    if (events_fd==-1) {
+        unsigned char c;
+        return read(STDIN_FILENO, &c, 1)==1 ? c : EOF;
     }
-    if (strcmp(command->name, "pause")==0) {   // suspends the given process
 
-        char cmd[100];
-        strcpy(cmd, "kill -TSTP ");
-        strcat(cmd, command->args[0]);
-        system(cmd);
-        return SUCCESS;
+    sigset_t old;
+    int key=EOF;
+    bool done=false;
+    sigprocmask(SIG_BLOCK, &events_signals, &old);
+    if (alarm_fd!=events_alarm_fd) {  // created, or closed and created again
+        struct epoll_event ev={.events=EPOLLIN, .data.fd=alarm_fd};
+        if (alarm_fd!=-1 && epoll_ctl(events_fd, EPOLL_CTL_ADD, alarm_fd, &ev)==0)
+            events_alarm_fd=alarm_fd;
+    }
+    if (job_notify_pending()) {  // finished while the previous line ran or keys were handled
+        prompt_clear();
+        job_notify();
+        prompt_redraw(buf, index);
+    }
+    while (!done) {
+        struct epoll_event ev[4];
+        int n=epoll_wait(events_fd, ev, 4, -1);
+        if (n==-1 && errno!=EINTR)
+            break;
+        for (int i=0; i<n; i++) {
+            int fd=ev[i].data.fd;
+            if (fd==events_signal_fd) {
+                if (prompt_signals(buf, index)==PROMPT_INTERRUPT && !done) {
+                    key=PROMPT_INTERRUPT;
+                    done=true;
+                }
+            } else if (fd==alarm_fd) {
+                prompt_clear();
+                alarm_run_due();
+                prompt_redraw(buf, index);
+            } else if (fd!=STDIN_FILENO)
+                capture_read_fd(fd);
+            else if (!done) {
+                ssize_t got=read(STDIN_FILENO, prompt_input.buf, sizeof(prompt_input.buf));
+                if (got==-1 && errno==EINTR)
+                    continue;
+                done=true;
+                if (got>0) {
+                    prompt_input.pos=1;
+                    prompt_input.len=got;
+                    key=prompt_input.buf[0];
+                }
+            }
+        }
     }
-    if (strcmp(command->name, "mybg")==0) { // puts a paused process at the background in running state
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return key;
+}
+/**
+ * Prompt a command from the user
+ * @param  line set to the parsed line, NULL if it was empty or had a syntax error
+ * @return      EXIT at the end of the input, SUCCESS otherwise
+ */
+int prompt(struct node_t **line)
+{
+    static struct strbuf input;  // the line being typed, grows as needed and is reused
+    int c;
+    long hist_pos=history_count();  // history line shown by the arrow keys
+
+    // tcgetattr gets the parameters of the current terminal
+    // STDIN_FILENO will tell tcgetattr that it should write the settings
+    // of stdin to oldt
+    static struct termios backup_termios, new_termios;
+    tcgetattr(STDIN_FILENO, &backup_termios);
+    new_termios = backup_termios;
+    // ICANON normally takes care that one line at a time will be processed
+    // that means it will return if it sees a "\n" or an EOF or an EOL
+    new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
+    // Those new settings will be set to STDIN
+    // TCSANOW tells tcsetattr to change attributes immediately.
+    tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+
+
+    //FIXME: backspace is applied before printing chars
+    show_prompt();
+    int multicode_state=0;
+    input.len=0;
+    strbuf_reserve(&input, 1);
+    while (1)
+    {
+        c=prompt_getchar(input.s, input.len);
+        if (c==EOF) // end of input
+        {
+            tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+            return EXIT;
+        }
+        // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+        if (c==PROMPT_INTERRUPT) // ^C drops the line
+        {
+            printf("^C\n");
+            prompt_pending.len=0;
+            input.len=0;
+            multicode_state=0;
+            hist_pos=history_count();
+            show_prompt();
+            continue;
+        }
+        if (c==32 && input.len==0)
+            continue;
+        
+        if (c==9) // handle tab
+        {
+            strbuf_add(&input, '?'); // autocomplete
+            break;
+        }
+
+        if (c==127) // handle backspace
+        {
+            if (input.len>0)
+            {
+                prompt_backspace();
+                input.len--;
+            }
+            continue;
+        }
+        if (c==27 && multicode_state==0) // handle multi-code keys
+        {
+            multicode_state=1;
+            continue;
+        }
+        if (c==91 && multicode_state==1)
+        {
+            multicode_state=2;
+            continue;
+        }
+        if ((c==65 || c==66) && multicode_state==2) // up and down arrows walk the history
+        {
+            int len=0;
+            const char *line="";
+            multicode_state=0;
+            if (c==65 && hist_pos>0)
+                line=history_get(--hist_pos, &len);
+            else if (c==66 && hist_pos<history_count()-1)
+                line=history_get(++hist_pos, &len);
+            else if (c==66)
+                hist_pos=history_count();  // past the newest line, back to an empty one
+            else
+                continue;
+            while (input.len>0)
+            {
+                prompt_backspace();
+                input.len--;
+            }
+            fwrite(line, 1, len, stdout);
+            strbuf_append(&input, line, len);
+            continue;
+        }
+        else
+            multicode_state=0;
+
+        putchar(c); // echo the character
+        strbuf_add(&input, c);
+        if (c=='\n') // enter key
+            break;
+        if (c==4) // Ctrl+D
+        {
+            tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+            return EXIT;
+        }
+    }
+    bool entered=input.len>0 && input.s[input.len-1]=='\n';
+    if (entered) // trim newline from the end
+        input.len--;
+    strbuf_add(&input, 0); // null terminate string
+    input.len--;
+
+    if (entered) // the whole line goes to the history, tab completions are not kept
+        history_add(input.s);
+
+    *line=NULL;
+    if (input.len>0 || prompt_pending.len>0) {    // to handle enter dump error
+        bool incomplete;
+        if (prompt_pending.len>0)
+            strbuf_add(&prompt_pending, '\n');
+        strbuf_append(&prompt_pending, input.s, input.len);
+        *line=parse_line(arena_strndup(&line_arena, prompt_pending.s, prompt_pending.len), &line_arena, &incomplete);
+        lines_parsed++;
+        if (!incomplete)
+            prompt_pending.len=0;
+    }
+
+    // restore the old settings
+    tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+    return SUCCESS;
+}
+int process_command(struct node_t *line);
+/*
+ * Batch mode: for -c, script files and input that is not a terminal, lines are
+ * read in large blocks and executed without touching termios or printing a prompt.
+ */
+#define READER_BLOCK 65536
 
-        char cmd[100];
-        strcpy(cmd, "kill -CONT ");
-        strcat(cmd, command->args[0]);
-        system(cmd);
+struct reader_t {
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t start;   // first byte not returned yet
+    size_t end;     // end of the data read so far
+    size_t scanned; // no newline between start and this, a long line is searched only once
+    bool eof;
+    bool discard;   // the line did not fit in memory, drop it up to its newline
+};
+/**
+ * Get the next line of input. The line is NUL terminated in place and stays
+ * valid until the next call.
+ * @return the line or NULL at the end of the input
+ */
+char *reader_line(struct reader_t *r)
+{
+    while (1) {
+        if (r->scanned<r->start)
+            r->scanned=r->start;
+        char *nl=r->end>r->scanned ? memchr(r->buf+r->scanned, '\n', r->end-r->scanned) : NULL;
+        if (nl!=NULL && r->discard) {
+            r->start=r->scanned=nl-r->buf+1;
+            r->discard=false;
+            continue;
+        }
+        if (nl!=NULL) {
+            char *line=r->buf+r->start;
+            *nl=0;
+            r->start=r->scanned=nl-r->buf+1;
+            return line;
+        }
+        r->scanned=r->end;
+        if (r->discard)
+            r->start=r->end;
+        if (r->eof) {
+            if (r->start==r->end)
+                return NULL;
+            char *line=r->buf+r->start;  // last line without a newline, there is always room for the NUL
+            r->buf[r->end]=0;
+            r->start=r->end;
+            return line;
+        }
+        if (r->start>0) {  // move the partial line to the front
+            memmove(r->buf, r->buf+r->start, r->end-r->start);
+            r->end-=r->start;
+            r->scanned-=r->start;
+            r->start=0;
+        }
+        if (r->cap-r->end<READER_BLOCK/2) {  // lines longer than a block make the buffer grow
+            size_t cap=r->cap ? r->cap*2 : READER_BLOCK;
+            char *buf=realloc(r->buf, cap);
+            if (buf==NULL && r->cap==0) {
+                fprintf(stderr, "-%s: %s\n", sysname, strerror(errno));
+                last_status=1;
+                return NULL;
+            }
+            if (buf==NULL) {
+                fprintf(stderr, "-%s: line too long: %s\n", sysname, strerror(errno));
+                last_status=1;
+                r->discard=true;
+                r->start=r->scanned=r->end=0;
+                continue;
+            }
+            r->buf=buf;
+            r->cap=cap;
+        }
+        ssize_t n=read(r->fd, r->buf+r->end, r->cap-r->end-1);
+        if (n<0 && errno==EINTR)
+            continue;
+        if (n<=0)
+            r->eof=true;
+        else
+            r->end+=n;
+    }
+}
+/**
+ * Parse and execute one line of a script. A line that leaves a compound command
+ * open is kept and run with the lines that complete it.
+ * @param  pending lines read so far of a command that is not complete
+ * @return EXIT if the script asked to exit, SUCCESS otherwise
+ */
+int run_line(struct strbuf *pending, const char *line)
+{
+    while (*line==' ' || *line=='\t')
+        line++;
+    if (pending->len==0 && (*line==0 || *line=='#'))  // blank lines, comments and #! lines
         return SUCCESS;
+
+    bool incomplete;
+    bool armed=line_abort_pid==0;  // a line run by source fails with the line that ran it
+    if (armed) {
+        if (sigsetjmp(line_abort, 1)!=0) {
+            line_abort_pid=0;
+            pending->len=0;
+            return SUCCESS;
+        }
+        line_abort_pid=getpid();
+    }
+    arena_reset(&line_arena);
+    if (pending->len>0)
+        strbuf_add(pending, '\n');
+    strbuf_append(pending, line, strlen(line));
+    char *buf=arena_strndup(&line_arena, pending->s, pending->len);
+    struct node_t *tree=parse_line(buf, &line_arena, &incomplete);
+    lines_parsed++;
+    int code=SUCCESS;
+    if (!incomplete)
+        pending->len=0;
+    if (!incomplete && tree!=NULL) {
+        code=execute_node(tree);  // not process_command(): a trailing '?' is only a Tab press at the prompt
+        job_notify();
+    }
+    if (armed)
+        line_abort_pid=0;
+    return code;
+}
+/**
+ * Report a compound command the input left open
+ */
+void run_end(struct strbuf *pending)
+{
+    if (pending->len>0 && !exit_requested) {
+        fprintf(stderr, "-%s: syntax error: unexpected end of file\n", sysname);
+        last_status=2;
+    }
+    free(pending->s);
+}
+/**
+ * Run every line read from a file descriptor
+ * @return the exit status of the shell
+ */
+int run_script(int fd)
+{
+    struct reader_t reader;
+    struct strbuf pending={NULL, 0, 0};
+    char *line;
+    memset(&reader, 0, sizeof(reader));
+    reader.fd=fd;
+    while ((line=reader_line(&reader))!=NULL)
+        if (run_line(&pending, line)==EXIT)
+            break;
+    run_end(&pending);
+    free(reader.buf);
+    fflush(stdout);
+    return last_status;
+}
+/**
+ * Run the lines of a -c argument
+ * @return the exit status of the shell
+ */
+int run_string(const char *script)
+{
+    struct strbuf pending={NULL, 0, 0};
+    char *copy=strdup(script), *line=copy;
+    while (line!=NULL) {
+        char *nl=strchr(line, '\n');
+        if (nl!=NULL)
+            *nl=0;
+        if (run_line(&pending, line)==EXIT)
+            break;
+        line=nl ? nl+1 : NULL;
+    }
+    run_end(&pending);
+    free(copy);
+    fflush(stdout);
+    return last_status;
+}
+/*
+ * Server mode: shellgibi --server PATH listens on a Unix socket and runs command
+ * lines for any number of clients from one long-lived process, so automation does
+ * not pay for a shell startup per batch. A client writes newline-terminated lines,
+ * which run one at a time per connection, each in a fork of the server. The reply
+ * to a line is a stream of frames:
+ *   O <len>\n<bytes>   what it wrote to stdout
+ *   E <len>\n<bytes>   what it wrote to stderr
+ *   X <status>\n       it finished
+ * The server parses every line and resolves its commands before forking, so the
+ * path cache that later requests inherit keeps getting warmer. Client sockets are
+ * non-blocking: frames go to a per-client queue that drains on EPOLLOUT, and a
+ * line's pipes are taken out of the epoll set while its client's queue is full,
+ * so a client that stops reading only ever stalls its own line.
+ */
+#define SERVER_BLOCK 65536
+#define SERVER_EVENTS 64
+#define SERVER_QUEUE_MAX (4*SERVER_BLOCK)  // queued bytes above which a line's output is left in its pipes
+
+struct server_client {
+    int fd;
+    bool eof;           // the client sent everything, reply and hang up
+    char *buf;          // received bytes not run yet
+    size_t len, cap;
+    pid_t pid;          // line being run, 0 when idle
+    bool exited;        // it has been reaped or never started, its output is still being forwarded
+    int status;         // and its wait status
+    int pidfd;          // -1 if the kernel has no pidfd, the loop polls then
+    int out, err;       // read ends of the line's stdout and stderr
+    bool paused;        // the pipes are out of the epoll set while the queue is full
+    struct strbuf queue;    // frames not sent yet, from sent on
+    size_t sent;
+    uint32_t events;    // what the epoll set waits for on fd
+    struct server_client *next;
+};
+struct server_client *server_clients=NULL;
+
+/**
+ * Send what the client's socket takes of its queue, without blocking
+ * @return 0 on success, -1 if the client is gone
+ */
+int server_flush(struct server_client *cl)
+{
+    while (cl->sent<cl->queue.len) {
+        ssize_t n=send(cl->fd, cl->queue.s+cl->sent, cl->queue.len-cl->sent, MSG_NOSIGNAL);
+        if (n==-1 && errno==EINTR)
+            continue;
+        if (n==-1 && errno==EAGAIN)
+            return 0;
+        if (n==-1)
+            return -1;
+        cl->sent+=n;
+    }
+    cl->queue.len=cl->sent=0;
+    return 0;
+}
+/**
+ * Queue a frame for the client
+ */
+void server_send(struct server_client *cl, const char *data, size_t len)
+{
+    if (cl->sent>0 && cl->sent>=cl->queue.len/2) {  // keep the unsent part at the front
+        memmove(cl->queue.s, cl->queue.s+cl->sent, cl->queue.len-cl->sent);
+        cl->queue.len-=cl->sent;
+        cl->sent=0;
+    }
+    strbuf_append(&cl->queue, data, len);
+}
+bool server_full(struct server_client *cl)
+{
+    return cl->queue.len-cl->sent>=SERVER_QUEUE_MAX;
+}
+/**
+ * Forward what a line wrote to one of its pipes, until the pipe is empty or the
+ * client's queue is full
+ * @param  fd   the pipe, set to -1 at EOF
+ * @param  type O or E
+ * @return      0 once the pipe is empty or closed, 1 if data was left in it
+ */
+int server_forward(struct server_client *cl, int *fd, char type)
+{
+    char buf[SERVER_BLOCK];
+    while (*fd!=-1) {
+        if (server_full(cl))
+            return 1;
+        int head=snprintf(buf, 32, "%c ", type);
+        ssize_t n=read(*fd, buf+32, sizeof(buf)-32);
+        if (n==-1 && errno==EINTR)
+            continue;
+        if (n==-1 && errno==EAGAIN)
+            return 0;
+        if (n<=0) {  // close() also takes it out of the epoll set
+            close(*fd);
+            *fd=-1;
+            return 0;
+        }
+        head+=snprintf(buf+head, 32-head, "%zd\n", n);
+        memmove(buf+32-head, buf, head);  // the header goes right before the data
+        server_send(cl, buf+32-head, head+n);
+    }
+    return 0;
+}
+/**
+ * Queue the rest of a line's output and its status, once it has exited
+ * @return false if output is left in the pipes until the queue drains
+ */
+bool server_finish(struct server_client *cl)
+{
+    char frame[32];
+    if (server_forward(cl, &cl->out, 'O')!=0 || server_forward(cl, &cl->err, 'E')!=0)
+        return false;
+    for (int *fd=&cl->out; fd<=&cl->err; fd++)  // background jobs of the line may still hold the pipes
+        if (*fd!=-1) {
+            close(*fd);
+            *fd=-1;
+        }
+    if (cl->pidfd!=-1)
+        close(cl->pidfd);
+    cl->pidfd=-1;
+    cl->pid=0;
+    cl->exited=false;
+    int n=snprintf(frame, sizeof(frame), "X %d\n", status_code(cl->status));
+    server_send(cl, frame, n);
+    return true;
+}
+/**
+ * Make the epoll set wait for what the client needs: its input until it shuts
+ * down, EPOLLOUT while frames are queued, and the line's pipes unless the queue is full
+ */
+void server_watch(struct server_client *cl, int epfd)
+{
+    uint32_t events=(cl->eof ? 0 : EPOLLIN) | (cl->sent<cl->queue.len ? EPOLLOUT : 0);
+    if (events!=cl->events) {
+        struct epoll_event ev={.events=events, .data.fd=cl->fd};
+        epoll_ctl(epfd, EPOLL_CTL_MOD, cl->fd, &ev);
+        cl->events=events;
+    }
+    if (server_full(cl)==cl->paused)
+        return;
+    cl->paused=!cl->paused;
+    for (int *fd=&cl->out; fd<=&cl->err; fd++)  // not just no events: a pipe at EOF would report EPOLLHUP
+        if (*fd!=-1) {
+            struct epoll_event ev={.events=EPOLLIN, .data.fd=*fd};
+            epoll_ctl(epfd, cl->paused ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, *fd, &ev);
+        }
+}
+/**
+ * Look up the path of every command of a line in the server itself
+ */
+void server_resolve(struct node_t *node)
+{
+    if (node==NULL)
+        return;
+    if (node->type!=NODE_PIPELINE) {
+        server_resolve(node->left);
+        server_resolve(node->right);
+        server_resolve(node->body);
+        return;
+    }
+    for (struct command_t *c=node->command; c!=NULL; c=c->next)
+        if (c->subshell!=NULL)
+            server_resolve(c->subshell);
+        else if (c->name[0]!=0 && !c->name_raw && find_builtin(c->name)==NULL && function_find(c->name)==NULL
+                 && !word_has_glob(c->name, strlen(c->name)))
+            findPath(c->name);
+}
+/**
+ * Start the next line of an idle client, if a complete one has arrived
+ * @return -1 if the pipes for it could not be made
+ */
+int server_next(struct server_client *cl, int epfd)
+{
+    char *nl;
+    while (cl->pid==0 && !cl->exited && (nl=memchr(cl->buf, '\n', cl->len))!=NULL) {
+        int out[2], err[2];
+        *nl=0;
+        arena_reset(&line_arena);
+        char *line=arena_strdup(&line_arena, cl->buf);
+        cl->len-=nl+1-cl->buf;
+        memmove(cl->buf, nl+1, cl->len);
+        if (pipe2(out, O_CLOEXEC)==-1)
+            return -1;
+        if (pipe2(err, O_CLOEXEC)==-1) {
+            close(out[0]);
+            close(out[1]);
+            return -1;
+        }
+
+        int saved=dup(STDERR_FILENO);
+        dup2(err[1], STDERR_FILENO);  // syntax errors go to the client
+        last_status=0;
+        struct node_t *tree=parse_line(line, &line_arena, NULL);
+        lines_parsed++;
+        dup2(saved, STDERR_FILENO);
+        close(saved);
+        server_resolve(tree);
+
+        pid_t pid=tree!=NULL ? fork() : -1;
+        if (pid==0) {
+            int devnull=open("/dev/null", O_RDONLY);
+            dup2(devnull, STDIN_FILENO);
+            dup2(out[1], STDOUT_FILENO);
+            dup2(err[1], STDERR_FILENO);
+            jobs_init();
+            execute_node(tree);
+            job_notify();
+            fflush(stdout);
+            _exit(last_status);
+        }
+        close(out[1]);
+        close(err[1]);
+        fcntl(out[0], F_SETFL, O_NONBLOCK);
+        fcntl(err[0], F_SETFL, O_NONBLOCK);
+        cl->out=out[0];
+        cl->err=err[0];
+        if (pid==-1) {  // an empty line or a syntax error, or fork() failed
+            if (tree!=NULL) {
+                fprintf(stderr, "-%s: fork: %s\n", sysname, strerror(errno));
+                last_status=1;
+            }
+            cl->status=W_EXITCODE(last_status, 0);
+            cl->exited=true;  // answered like a line that ran, its error first
+            server_finish(cl);
+            continue;
+        }
+        cl->pid=pid;
+        cl->pidfd=syscall(SYS_pidfd_open, pid, 0);
+        cl->paused=server_full(cl);
+        int fds[3]={cl->paused ? -1 : cl->out, cl->paused ? -1 : cl->err, cl->pidfd};
+        for (int i=0; i<3; i++)
+            if (fds[i]!=-1) {
+                struct epoll_event ev={.events=EPOLLIN, .data.fd=fds[i]};
+                epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev);
+            }
+    }
+    return 0;
+}
+/**
+ * Read what a client sent
+ * @return -1 if the connection failed
+ */
+int server_receive(struct server_client *cl)
+{
+    while (1) {
+        if (cl->cap-cl->len<SERVER_BLOCK/2) {
+            cl->cap=cl->cap ? cl->cap*2 : SERVER_BLOCK;
+            cl->buf=realloc(cl->buf, cl->cap);
+        }
+        ssize_t n=recv(cl->fd, cl->buf+cl->len, cl->cap-cl->len-1, MSG_DONTWAIT);
+        if (n==-1 && errno==EINTR)
+            continue;
+        if (n==-1 && errno==EAGAIN)
+            return 0;
+        if (n==-1)
+            return -1;
+        if (n==0) {  // shut down for writing: run what is left, the last line may lack its newline
+            cl->eof=true;
+            if (cl->len>0 && cl->buf[cl->len-1]!='\n')
+                cl->buf[cl->len++]='\n';
+            return 0;
+        }
+        cl->len+=n;
+    }
+}
+void server_drop(struct server_client *cl)
+{
+    struct server_client **p=&server_clients;
+    while (*p!=cl)
+        p=&(*p)->next;
+    *p=cl->next;
+    if (cl->pid!=0 && !cl->exited) {  // nobody will read the reply
+        kill(cl->pid, SIGTERM);
+        waitpid(cl->pid, NULL, 0);
+    }
+    for (int *fd=&cl->out; fd<=&cl->err; fd++)
+        if (*fd!=-1)
+            close(*fd);
+    if (cl->pidfd!=-1)
+        close(cl->pidfd);
+    close(cl->fd);
+    free(cl->buf);
+    free(cl->queue.s);
+    free(cl);
+}
+/**
+ * Handle an event on one of a client's descriptors
+ * @param  events what epoll reported for fd
+ * @return -1 if the client should be dropped
+ */
+int server_event(struct server_client *cl, int fd, uint32_t events, int epfd)
+{
+    if (fd==cl->fd && (events & (EPOLLERR | EPOLLHUP)))  // closed, not just shut down for writing
+        return -1;
+    if (fd==cl->fd && !cl->eof && server_receive(cl)==-1)
+        return -1;
+    if (server_flush(cl)==-1)
+        return -1;
+    if (fd==cl->out)
+        server_forward(cl, &cl->out, 'O');
+    if (fd==cl->err)
+        server_forward(cl, &cl->err, 'E');
+    if (cl->pid!=0 && !cl->exited && (fd==cl->pidfd || cl->pidfd==-1)
+        && waitpid(cl->pid, &cl->status, WNOHANG)==cl->pid) {
+        cl->exited=true;
+        if (cl->pidfd!=-1)  // stays readable, and the pipes are enough to wait on now
+            close(cl->pidfd);
+        cl->pidfd=-1;
+    }
+    if (cl->exited)
+        server_finish(cl);
+    if (server_next(cl, epfd)==-1 || server_flush(cl)==-1)
+        return -1;
+    server_watch(cl, epfd);
+    return cl->eof && cl->pid==0 && !cl->exited && cl->sent==cl->queue.len ? -1 : 0;  // everything it sent has been answered
+}
+/**
+ * Run the server until it is killed
+ * @param  path where to create the socket, an old socket there is replaced but
+ *              nothing else. Only the server's user may connect: a client can
+ *              run any command as that user.
+ * @return      exit status of the shell
+ */
+int server_run(const char *path)
+{
+    struct sockaddr_un addr={.sun_family=AF_UNIX};
+    if (strlen(path)>=sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: %s: %s\n", sysname, path, strerror(ENAMETOOLONG));
+        return 2;
+    }
+    strcpy(addr.sun_path, path);
+    struct stat st;
+    if (lstat(path, &st)==0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s: %s: %s\n", sysname, path, strerror(EEXIST));
+            return 2;
+        }
+        unlink(path);
+    }
+    int lfd=socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int epfd=epoll_create1(EPOLL_CLOEXEC);
+    mode_t mask=umask(0077);  // the socket is created srwx------
+    int bound=lfd!=-1 ? bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) : -1;
+    umask(mask);
+    if (lfd==-1 || epfd==-1 || bound==-1 || listen(lfd, SOMAXCONN)==-1) {
+        fprintf(stderr, "%s: %s: %s\n", sysname, path, strerror(errno));
+        return 2;
+    }
+    struct epoll_event ev={.events=EPOLLIN, .data.fd=lfd};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+
+    while (1) {
+        struct epoll_event events[SERVER_EVENTS];
+        bool polling=false;  // a line runs without a pidfd
+        for (struct server_client *cl=server_clients; cl!=NULL; cl=cl->next)
+            polling|=cl->pid!=0 && !cl->exited && cl->pidfd==-1;
+        int n=epoll_wait(epfd, events, SERVER_EVENTS, polling ? 10 : -1);
+        if (n==-1 && errno!=EINTR) {
+            fprintf(stderr, "%s: epoll_wait: %s\n", sysname, strerror(errno));
+            return 1;
+        }
+        for (int i=0; i<n; i++) {
+            int fd=events[i].data.fd;
+            if (fd==lfd) {
+                int cfd=accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+                if (cfd==-1)
+                    continue;
+                struct server_client *cl=calloc(1, sizeof(struct server_client));
+                cl->fd=cfd;
+                cl->pidfd=cl->out=cl->err=-1;
+                cl->events=EPOLLIN;
+                cl->next=server_clients;
+                server_clients=cl;
+                ev.data.fd=cfd;
+                epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &ev);
+                continue;
+            }
+            for (struct server_client *cl=server_clients; cl!=NULL; cl=cl->next)
+                if (fd==cl->fd || fd==cl->out || fd==cl->err || fd==cl->pidfd) {
+                    if (server_event(cl, fd, events[i].events, epfd)==-1)
+                        server_drop(cl);
+                    break;
+                }
+        }
+        if (polling)
+            for (struct server_client *cl=server_clients, *next; cl!=NULL; cl=next) {
+                next=cl->next;
+                if (cl->pid!=0 && !cl->exited && cl->pidfd==-1 && server_event(cl, -1, 0, epfd)==-1)
+                    server_drop(cl);
+            }
+    }
+}
+int main(int argc, char *argv[])
+{
+    if (argc==3 && strcmp(argv[1], "--zygote")==0)  // the launch helper, see zygote_start()
+        return zygote_main(atoi(argv[2]));
+    shell_pid=getpid();
+    launch_init();
+    trace_init();
+    capture_init();
+
+    if (argc==3 && strcmp(argv[1], "--server")==0)  // no jobs_init(): the loop reaps its children itself
+        return server_run(argv[2]);
+    if (argc>1) {  // shellgibi -c 'command' or shellgibi script
+        jobs_init();
+        if (strcmp(argv[1], "-c")==0) {
+            if (argc<3) {
+                fprintf(stderr, "%s: -c: option requires an argument\n", sysname);
+                return 2;
+            }
+            return run_string(argv[2]);
+        }
+        int fd=open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd==-1) {
+            fprintf(stderr, "%s: %s: %s\n", sysname, argv[1], strerror(errno));
+            return 127;
+        }
+        return run_script(fd);
+    }
+
+    interactive=isatty(STDIN_FILENO);
+    jobs_init();
+    if (!interactive)  // commands piped into the shell
+        return run_script(STDIN_FILENO);
+
+    history_init();
+    events_init();
+    struct termios shell_termios;
+    tcgetattr(STDIN_FILENO, &shell_termios);
+    line_abort_pid=getpid();
+    while (1)
+    {
+        if (sigsetjmp(line_abort, 1)!=0) {  // out of memory: give the terminal back and drop the line
+            tcsetattr(STDIN_FILENO, TCSANOW, &shell_termios);
+            tcsetpgrp(STDIN_FILENO, shell_pgid);
+            continue;
+        }
+        arena_reset(&line_arena); // releases the previous line in one go
+        struct node_t *line;
+
+        int code;
+        job_notify();
+        code = prompt(&line);
+        if (code==EXIT) break;
+
+        interrupted=0;
+        if(line!=NULL)
+            code = process_command(line);
+        if (interrupted) {  // ^C stopped a loop, the prompt goes on a line of its own
+            printf("\n");
+            last_status=128+SIGINT;
+        }
+        if (code==EXIT) break;
+    }
+
+    printf("\n");
+    return last_status;
+}
+
+int process_command(struct node_t *line)
+{
+    struct command_t *command=line_last(line);
+    if (command!=NULL && command->auto_complete) {   // when Tab key pressed autocomplete part is executed
+        if (autocomplete(command)==0)
+            return SUCCESS;  // candidates were listed, nothing to run
+    }
+
+    return execute_node(line);
+}
+/*
+ * Execution: the tree of a line is never changed while it runs, so the body of
+ * a loop or a function is parsed once and run as often as needed. Each pipeline
+ * is copied into exec_arena, expanded and run there, and the copy is released
+ * as soon as it finished; builtins run in the shell without forking.
+ */
+int jump=JUMP_NONE;     // a break, continue or return that is leaving the nodes it is in
+int jump_levels=0;      // loops a break or continue still has to leave
+int loop_depth=0;       // loops running, for break and continue
+int function_depth=0;   // function calls running, for return
+
+/**
+ * Check after the body of a loop whether the loop must stop: a break or continue
+ * aimed at this loop is consumed, an outer one or a return goes on
+ * @return true to leave the loop
+ */
+bool loop_stop()
+{
+    if (interactive && last_status==128+SIGINT)  // ^C killed a command, it stops the loops around it too
+        interrupted=1;
+    if (interrupted)
+        return true;
+    if (jump==JUMP_NONE)
+        return false;
+    if (jump==JUMP_RETURN || --jump_levels>0)
+        return true;
+    bool stop=jump==JUMP_BREAK;
+    jump=JUMP_NONE;
+    return stop;
+}
+/**
+ * Run a for loop: the words expand once, then the body runs for each of them
+ */
+int execute_for(struct node_t *node)
+{
+    struct arena_mark mark=arena_mark(&exec_arena);
+    struct command_t *words=command_copy(&exec_arena, node->command);
+    int code=SUCCESS;
+    if (expand_command(words)==-1)
+        last_status=1;
+    else {
+        last_status=0;
+        loop_depth++;
+        for (int i=0; i<words->arg_count && code!=EXIT; i++) {
+            var_set(words->name, words->args[i]);
+            code=execute_node(node->body);
+            if (loop_stop())
+                break;
+        }
+        loop_depth--;
+    }
+    arena_release(&exec_arena, mark);
+    return code;
+}
+/**
+ * Run a while or until loop
+ */
+int execute_while(struct node_t *node)
+{
+    int code=SUCCESS, status=0;
+    loop_depth++;
+    while (code!=EXIT) {
+        code=execute_node(node->left);
+        if (code==EXIT || loop_stop() || (last_status==0)!=(node->type==NODE_WHILE))
+            break;
+        code=execute_node(node->body);
+        status=last_status;
+        if (loop_stop())
+            break;
+    }
+    loop_depth--;
+    last_status=status;
+    return code;
+}
+/**
+ * Walk a parsed line: && and || look at the status of their left side, only
+ * pipelines start processes
+ * @return EXIT if the shell should terminate, SUCCESS otherwise
+ */
+int execute_node(struct node_t *node)
+{
+    int code;
+    switch (node->type) {
+    case NODE_AND:
+    case NODE_OR:
+        code=execute_node(node->left);
+        if (code==EXIT || jump!=JUMP_NONE || interrupted || (last_status==0)!=(node->type==NODE_AND))
+            return code;
+        return execute_node(node->right);
+    case NODE_SEQ:
+        code=execute_node(node->left);
+        if (code==EXIT || jump!=JUMP_NONE || interrupted)
+            return code;
+        return execute_node(node->right);
+    case NODE_FOR:
+        return execute_for(node);
+    case NODE_WHILE:
+    case NODE_UNTIL:
+        return execute_while(node);
+    case NODE_IF:
+        code=execute_node(node->left);
+        if (code==EXIT || jump!=JUMP_NONE || interrupted)
+            return code;
+        if (last_status==0)
+            return execute_node(node->body);
+        last_status=0;
+        return node->right!=NULL ? execute_node(node->right) : SUCCESS;
+    case NODE_FUNCTION:
+        last_status=function_define(node->command->name, node->text);
+        return SUCCESS;
+    default:
+        return execute_command(node->command);
+    }
+}
+/**
+ * Copy the stages of a pipeline, so that expanding them leaves the parsed line as it is
+ * @return the copy, allocated in the arena
+ */
+struct command_t *command_copy(struct arena_t *arena, struct command_t *command)
+{
+    struct command_t *first=NULL, **tail=&first;
+    for (struct command_t *c=command; c!=NULL; c=c->next) {
+        struct command_t *copy=arena_alloc(arena, sizeof(struct command_t));
+        *copy=*c;
+        copy->arena=arena;
+        copy->args=arena_alloc(arena, sizeof(char *)*(c->arg_count+1));
+        memcpy(copy->args, c->args, sizeof(char *)*(c->arg_count+1));
+        struct redirect_t **r=&copy->redirects;
+        for (struct redirect_t *from=c->redirects; from!=NULL; from=from->next) {
+            *r=arena_alloc(arena, sizeof(struct redirect_t));
+            **r=*from;
+            r=&(*r)->next;
+        }
+        *tail=copy;
+        tail=&copy->next;
+    }
+    return first;
+}
+/**
+ * Run a pipeline of a parsed line on a copy that lives until it finished
+ * @return EXIT if the shell should terminate, SUCCESS otherwise
+ */
+int execute_command(struct command_t *command)
+{
+    struct arena_mark mark=arena_mark(&exec_arena);
+    int code=execute_stages(command_copy(&exec_arena, command));
+    arena_release(&exec_arena, mark);
+    return code;
+}
+/**
+ * Export variables until env_restore(), for the command they prefix
+ * @return their old values, NULL for unset ones, allocated in the arena
+ */
+char **env_apply(struct arena_t *arena, char **names, char **values, int count)
+{
+    char **saved=arena_alloc(arena, sizeof(char *)*count);
+    for (int i=0; i<count; i++) {
+        const char *old=getenv(names[i]);
+        saved[i]=old ? arena_strdup(arena, old) : NULL;
+        setenv(names[i], values[i], 1);
+    }
+    return saved;
+}
+void env_restore(char **names, char **saved, int count)
+{
+    for (int i=count-1; i>=0; i--)
+        if (saved[i]!=NULL)
+            setenv(names[i], saved[i], 1);
+        else
+            unsetenv(names[i]);
+}
+/**
+ * Run the name=value words before a command. Alone they set shell variables,
+ * before a command they are put in its environment while it runs. In a
+ * pipeline only the first stage gets them, runPipe() exports them around its launch.
+ */
+int execute_assigns(struct command_t *command)
+{
+    int count=command->assign_count, code=SUCCESS;
+    char **names=arena_alloc(command->arena, sizeof(char *)*count);
+    char **values=arena_alloc(command->arena, sizeof(char *)*count);
+    last_status=0;  // unless a substitution in a value fails
+    for (int i=0; i<count; i++) {
+        char *eq=strchr(command->assigns[i], '=');
+        names[i]=arena_strndup(command->arena, command->assigns[i], eq-command->assigns[i]);
+        values[i]=word_expand_string(command->arena, eq+1);
+        if (values[i]==NULL) {
+            last_status=1;
+            return SUCCESS;
+        }
+    }
+    command->assign_count=0;
+    if (command->name[0]==0 && command->next==NULL) {
+        for (int i=0; i<count; i++)
+            var_set(names[i], values[i]);
+        return SUCCESS;
+    }
+    if (command->next!=NULL) {
+        command->env_names=names;
+        command->env_values=values;
+        command->env_count=count;
+        return execute_stages(command);
+    }
+    char **saved=env_apply(command->arena, names, values, count);
+    code=execute_stages(command);
+    env_restore(names, saved, count);
+    return code;
+}
+/**
+ * Run an expanded pipeline: builtins and functions in the shell, everything else as a job
+ * @return EXIT if the shell should terminate, SUCCESS otherwise
+ */
+int execute_stages(struct command_t *command)
+{
+    if (command->timed)  // a prefix, not a stage: it times the whole pipeline
+        return time_command(command);
+    if (command->assign_count>0)
+        return execute_assigns(command);
+    if (command->name[0]==0 && command->next==NULL)  // nothing to run
+        return SUCCESS;
+    for (struct command_t *c=command; c!=NULL; c=c->next) {
+        if (expand_command(c)==-1) {
+            last_status=1;
+            return SUCCESS;
+        }
+        if (strcmp(c->name, "rctl")==0 && c->subshell==NULL && rctl_parse(c)==-1) {
+            last_status=2;
+            return SUCCESS;
+        }
+    }
+    if (command->name[0]==0 && command->next==NULL)  // only substitutions with no output
+        return SUCCESS;
+
+    // a lone function runs in the shell itself, like a lone builtin unless its output is redirected
+    struct function_t *function=function_find(command->name);
+    const struct builtin_t *builtin=function ? NULL : find_builtin(command->name);
+    bool redirected=command->redirects!=NULL;
+    if (function!=NULL && command->next==NULL && !redirected && command->rctl==NULL)
+        return function_call(function, command, false);
+    if (builtin!=NULL && command->next==NULL && (builtin->flags & BUILTIN_PARENT) && command->rctl==NULL
+        && (!redirected || !(builtin->flags & BUILTIN_PIPE))) {
+        bool traced=trace_fd!=-1;  // a builtin that turns tracing on started untraced and is not logged
+        double start=traced ? wall_us() : 0;
+        last_status=redirected ? redirect_builtin(builtin, command) : builtin->handler(command);
+        fflush(stdout);  // keep the order with what the next commands write
+        if (traced && trace_fd!=-1)
+            trace_builtin(command->name, start, wall_us(), last_status);
+        return exit_requested ? EXIT : SUCCESS;
+    }
+
+    // resolve the command in the parent so that the path cache survives the fork
+    for (struct command_t *c=command; c!=NULL; c=c->next) {
+        if (function_find(c->name)!=NULL)
+            continue;
+        builtin=find_builtin(c->name);
+        if (builtin!=NULL && !(builtin->flags & BUILTIN_PIPE)) {
+            fprintf(stderr, "-%s: %s: cannot be used %s\n", sysname, c->name,
+                    c->rctl!=NULL ? "with rctl" : "in a pipeline");
+            last_status=1;
+            return SUCCESS;
+        }
+        if (builtin==NULL && c->subshell==NULL && findPath(c->name)==NULL) {
+            fprintf(stderr, "-%s: %s: command not found\n", sysname, c->name);
+            last_status=127;
+            return SUCCESS;
+        }
+    }
+
+    last_status=runPipe(command);  // a single command is a pipeline with one stage
+    return SUCCESS;
+}
+/*
+ * History: every command line is appended to an append-only log file shared by
+ * all shellgibi processes (one write() per line with O_APPEND, so concurrent
+ * shells never interleave). At startup the log is memory-mapped, and an index of
+ * line offsets is built the first time it is needed, so any entry can be recalled
+ * in O(1). Lines entered in this session are kept in a separate array.
+ */
+int hist_fd=-1;
+char *hist_map=NULL;        // the log as it was when the shell started
+size_t hist_map_size=0;
+size_t *hist_offsets=NULL;  // start of every mapped line, plus one past the last line
+long hist_mapped=-1;        // number of mapped lines, -1 until the index is built
+char **hist_session=NULL;   // lines added since startup
+long hist_nsession=0, hist_session_cap=0;
+
+/**
+ * Open and map the history log, $SHELLGIBI_HISTFILE or ~/.shellgibi_history
+ */
+void history_init()
+{
+    char path[PATH_MAX];
+    const char *file=getenv("SHELLGIBI_HISTFILE");
+    if (file==NULL) {
+        const char *home=getenv("HOME");
+        if (home==NULL)
+            return;
+        snprintf(path, sizeof(path), "%s/.shellgibi_history", home);
+        file=path;
+    }
+    hist_fd=open(file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (hist_fd==-1)
+        return;
+    struct stat st;
+    if (fstat(hist_fd, &st)==0 && st.st_size>0) {
+        hist_map=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, hist_fd, 0);
+        if (hist_map==MAP_FAILED)
+            hist_map=NULL;
+        else
+            hist_map_size=st.st_size;
+    }
+}
+/**
+ * Build the offset index of the mapped log
+ */
+void history_index()
+{
+    long cap=1024;
+    hist_mapped=0;
+    hist_offsets=malloc(sizeof(size_t)*cap);
+    size_t pos=0;
+    while (pos<hist_map_size) {
+        char *nl=memchr(hist_map+pos, '\n', hist_map_size-pos);
+        if (nl==NULL)  // a partial line at the end, another shell is writing it
+            break;
+        if (hist_mapped+1>=cap) {
+            cap*=2;
+            hist_offsets=realloc(hist_offsets, sizeof(size_t)*cap);
+        }
+        hist_offsets[hist_mapped++]=pos;
+        pos=nl-hist_map+1;
+    }
+    hist_offsets[hist_mapped]=pos;
+}
+/**
+ * Number of lines in the history
+ */
+long history_count()
+{
+    if (hist_mapped==-1)
+        history_index();
+    return hist_mapped+hist_nsession;
+}
+/**
+ * Get a history line, 0 being the oldest
+ * @param  i   [description]
+ * @param  len set to the length of the line, which is not NUL terminated
+ * @return     pointer to the line
+ */
+const char *history_get(long i, int *len)
+{
+    if (hist_mapped==-1)
+        history_index();
+    if (i<hist_mapped) {
+        *len=hist_offsets[i+1]-hist_offsets[i]-1;
+        return hist_map+hist_offsets[i];
+    }
+    *len=strlen(hist_session[i-hist_mapped]);
+    return hist_session[i-hist_mapped];
+}
+/**
+ * Store a command line in the history
+ */
+void history_add(const char *line)
+{
+    size_t len=strlen(line);
+    if (len==0)
+        return;
+    if (hist_nsession==hist_session_cap) {
+        long cap=hist_session_cap ? hist_session_cap*2 : 64;
+        char **lines=realloc(hist_session, sizeof(char *)*cap);
+        if (lines!=NULL) {
+            hist_session=lines;
+            hist_session_cap=cap;
+        }
+    }
+    char *copy=hist_nsession<hist_session_cap ? strdup(line) : NULL;
+    if (copy!=NULL)  // out of memory: the line is still logged, just not recalled
+        hist_session[hist_nsession++]=copy;
+
+    if (hist_fd!=-1) {
+        struct iovec entry[2]={{(void *)line, len}, {"\n", 1}};
+        ssize_t n;
+        while ((n=writev(hist_fd, entry, 2))==-1 && errno==EINTR)  // a single append keeps lines of concurrent shells apart
+            ;
+        if (n!=(ssize_t)len+1) {  // a full disk or a broken file: stop logging instead of failing on every line
+            fprintf(stderr, "-%s: history: %s\n", sysname, n==-1 ? strerror(errno) : "short write");
+            close(hist_fd);
+            hist_fd=-1;
+        }
+    }
+}
+
+/*
+ * Builtin commands. Each one is a handler in the builtins[] table below, which
+ * is kept sorted by name and searched with bsearch(). A handler returns the
+ * exit status of the command.
+ */
+int builtin_cd(struct command_t *command)
+{
+    const char *dir=command->arg_count>0 ? command->args[0] : getenv("HOME");
+    if (dir==NULL || chdir(dir)==-1) {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, dir ? strerror(errno) : "HOME not set");
+        return 1;
+    }
+    return 0;
+}
+int builtin_exit(struct command_t *command)
+{
+    exit_requested=true;
+    return command->arg_count>0 ? atoi(command->args[0]) : last_status;
+}
+int builtin_export(struct command_t *command)  // sets environment variables, e.g. export PATH=/usr/bin:/bin
+{
+    int result=0;
+    for (int i=0; i<command->arg_count; i++) {
+        char *eq=strchr(command->args[i], '=');
+        const char *value=NULL;
+        if (eq!=NULL) {
+            *eq=0;
+            value=eq+1;
+        } else if ((value=var_get(command->args[i]))==NULL)  // export name moves a shell variable
+            continue;
+        char *copy=strdup(value);
+        var_unset(command->args[i]);
+        if (setenv(command->args[i], copy, 1)==-1) {
+            fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(errno));
+            result=1;
+        }
+        free(copy);
+        if (eq!=NULL)
+            *eq='=';
+    }
+    return result;
+}
+int builtin_unset(struct command_t *command)  // removes variables, or functions with -f
+{
+    bool function=command->arg_count>0 && strcmp(command->args[0], "-f")==0;
+    for (int i=function; i<command->arg_count; i++)
+        if (function)
+            function_remove(command->args[i]);
+        else
+            var_unset(command->args[i]);
+    return 0;
+}
+int builtin_true(struct command_t *command)  // true and :, does nothing successfully
+{
+    return 0;
+}
+int builtin_false(struct command_t *command)
+{
+    return 1;
+}
+int builtin_echo(struct command_t *command)  // prints its arguments, -n without the newline, -e with backslash escapes
+{
+    bool newline=true, escapes=false;
+    int i;
+    for (i=0; i<command->arg_count; i++) {  // options like -n, -e, -E or -ne
+        const char *a=command->args[i];
+        if (a[0]!='-' || a[1]==0 || a[strspn(a+1, "neE")+1]!=0)
+            break;
+        for (a++; *a; a++)
+            if (*a=='n')
+                newline=false;
+            else
+                escapes=*a=='e';
+    }
+    for (bool first=true; i<command->arg_count; i++, first=false) {
+        if (!first)
+            putchar(' ');
+        if (!escapes) {  // a long argument list is written a word at a time
+            fputs(command->args[i], stdout);
+            continue;
+        }
+        for (const char *a=command->args[i]; *a; a++) {
+            const char *from="abefnrtv\\", *to="\a\b\033\f\n\r\t\v\\";
+            const char *esc=escapes && a[0]=='\\' && a[1]!=0 ? strchr(from, a[1]) : NULL;
+            if (escapes && a[0]=='\\' && a[1]=='c')  // \c stops the output
+                return 0;
+            if (escapes && a[0]=='\\' && a[1]=='0') {
+                int c=0, n;
+                for (n=0, a+=2; n<3 && *a>='0' && *a<='7'; n++, a++)
+                    c=c*8+*a-'0';
+                putchar(c);
+                a--;
+            } else if (esc!=NULL) {
+                putchar(to[esc-from]);
+                a++;
+            } else
+                putchar(*a);
+        }
+    }
+    if (newline)
+        putchar('\n');
+    return 0;
+}
+/**
+ * Evaluate a test expression of one to four arguments
+ * @return 0 true, 1 false, 2 for an invalid expression
+ */
+int test_eval(struct command_t *command, char **a, int n)
+{
+    struct stat st;
+    if (n==0)
+        return 1;
+    if (n==1)
+        return a[0][0]==0;
+    if (strcmp(a[0], "!")==0 && n<=4) {
+        int result=test_eval(command, a+1, n-1);
+        return result==2 ? 2 : !result;
+    }
+    if (n==2) {
+        char op=a[0][0]=='-' && a[0][1]!=0 && a[0][2]==0 ? a[0][1] : 0;
+        if (op=='n' || op=='z')
+            return (a[1][0]==0)==(op=='n');
+        if (op!=0 && strchr("efdrwxsL", op)!=NULL) {
+            if (op=='r' || op=='w' || op=='x')
+                return access(a[1], op=='r' ? R_OK : op=='w' ? W_OK : X_OK)!=0;
+            if ((op=='L' ? lstat(a[1], &st) : stat(a[1], &st))==-1)
+                return 1;
+            return !(op=='e' || (op=='f' && S_ISREG(st.st_mode)) || (op=='d' && S_ISDIR(st.st_mode))
+                     || (op=='s' && st.st_size>0) || (op=='L' && S_ISLNK(st.st_mode)));
+        }
+        fprintf(stderr, "-%s: %s: %s: unary operator expected\n", sysname, command->name, a[0]);
+        return 2;
+    }
+    if (n==3) {
+        static const char *ops[]={"-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL};
+        if (strcmp(a[1], "=")==0 || strcmp(a[1], "==")==0)
+            return strcmp(a[0], a[2])!=0;
+        if (strcmp(a[1], "!=")==0)
+            return strcmp(a[0], a[2])==0;
+        for (int i=0; ops[i]!=NULL; i++) {
+            if (strcmp(a[1], ops[i])!=0)
+                continue;
+            char *end0, *end2;
+            long x=strtol(a[0], &end0, 10), y=strtol(a[2], &end2, 10);
+            if (a[0][0]==0 || *end0!=0 || a[2][0]==0 || *end2!=0) {
+                fprintf(stderr, "-%s: %s: integer expression expected\n", sysname, command->name);
+                return 2;
+            }
+            bool r[]={x==y, x!=y, x<y, x<=y, x>y, x>=y};
+            return !r[i];
+        }
+        fprintf(stderr, "-%s: %s: %s: binary operator expected\n", sysname, command->name, a[1]);
+        return 2;
+    }
+    fprintf(stderr, "-%s: %s: too many arguments\n", sysname, command->name);
+    return 2;
+}
+int builtin_test(struct command_t *command)  // test and [, checks strings, numbers and files
+{
+    int n=command->arg_count;
+    if (command->name[0]=='[') {
+        if (n==0 || strcmp(command->args[n-1], "]")!=0) {
+            fprintf(stderr, "-%s: [: missing `]'\n", sysname);
+            return 2;
+        }
+        n--;
+    }
+    return test_eval(command, command->args, n);
+}
+/**
+ * Parse the loop count of break and continue
+ * @return the count, 0 if it is invalid
+ */
+int loop_count(struct command_t *command)
+{
+    int n=command->arg_count>0 ? atoi(command->args[0]) : 1;
+    if (n<1) {
+        fprintf(stderr, "-%s: %s: %s: loop count out of range\n", sysname, command->name, command->args[0]);
+        return 0;
+    }
+    return n<loop_depth ? n : loop_depth;
+}
+int builtin_break(struct command_t *command)  // leaves the innermost loop, or n loops
+{
+    int n=loop_depth>0 ? loop_count(command) : 0;
+    if (loop_depth==0)
+        fprintf(stderr, "-%s: %s: only meaningful in a `for', `while', or `until' loop\n", sysname, command->name);
+    if (n==0)
+        return loop_depth>0;
+    jump=command->name[0]=='b' ? JUMP_BREAK : JUMP_CONTINUE;
+    jump_levels=n;
+    return 0;
+}
+int builtin_return(struct command_t *command)  // leaves the running function
+{
+    if (function_depth==0) {
+        fprintf(stderr, "-%s: %s: can only `return' from a function\n", sysname, command->name);
+        return 1;
+    }
+    jump=JUMP_RETURN;
+    return command->arg_count>0 ? atoi(command->args[0]) & 255 : last_status;
+}
+int builtin_hash(struct command_t *command)  // shows or flushes the command path cache
+{
+    int result=0;
+    if (command->arg_count==0) {
+        hash_print();
+        return 0;
+    }
+    for (int i=0; i<command->arg_count; i++) {
+        if (strcmp(command->args[i], "-r")==0)
+            hash_flush();
+        else if (findPath(command->args[i])==NULL) {
+            fprintf(stderr, "-%s: %s: %s: not found\n", sysname, command->name, command->args[i]);
+            result=1;
+        }
+    }
+    return result;
+}
+int builtin_launcher(struct command_t *command)  // selects how external commands are started and shows their latency
+{
+    if (command->arg_count==0)
+        launch_report();
+    else switch (launch_select(command->args[0])) {
+    case -1:
+        fprintf(stderr, "-%s: %s: unknown mode %s (use spawn, fork, zygote or -r)\n", sysname, command->name, command->args[0]);
+        // fall through
+    case -2:
+        return 1;
+    }
+    return 0;
+}
+int builtin_trace(struct command_t *command)  // logs spawn, exec and reap times of every process to a file
+{
+    if (command->arg_count==0) {
+        printf("trace: %s\n", trace_fd!=-1 ? "on" : "off");
+        return 0;
+    }
+    if (trace_open(strcmp(command->args[0], "off")==0 ? NULL : command->args[0])==-1) {
+        fprintf(stderr, "-%s: %s: %s: %s\n", sysname, command->name, command->args[0], strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+int builtin_parallel(struct command_t *command)  // runs a command for many items, N at a time
+{
+    return parallel_run(command);
+}
+int builtin_bgcapture(struct command_t *command)  // keeps the output of background jobs in memory instead of the terminal
+{
+    if (command->arg_count==0) {
+        if (capture_size==0)
+            printf("bgcapture: off\n");
+        else
+            printf("bgcapture: %zu bytes per job\n", capture_size);
+        return 0;
+    }
+    if (capture_config(command->args[0])==-1) {
+        fprintf(stderr, "-%s: %s: %s: invalid size (use off or a size like 64K, at most 1G)\n", sysname, command->name, command->args[0]);
+        return 1;
+    }
+    return 0;
+}
+int builtin_joblog(struct command_t *command)  // shows or follows the captured output of a background job
+{
+    bool follow=command->arg_count>0 && strcmp(command->args[0], "-f")==0;
+    if (command->arg_count==follow) {
+        capture_list();
+        return 0;
+    }
+    if (capture_show(command->args[follow], follow)!=0) {
+        fprintf(stderr, "-%s: %s: %s: no captured output\n", sysname, command->name, command->args[follow]);
+        return 1;
+    }
+    return 0;
+}
+int builtin_jobs(struct command_t *command)  // lists the shell's jobs
+{
+    jobs_list();
+    return 0;
+}
+int builtin_fg(struct command_t *command)  // puts a job at the foreground in running state
+{
+    return job_continue(command->name, command->args[0], true, command->name[0]=='m');
+}
+int builtin_bg(struct command_t *command)  // puts a paused job at the background in running state
+{
+    return job_continue(command->name, command->args[0], false, command->name[0]=='m');
+}
+int builtin_pause(struct command_t *command)  // suspends the given job or process
+{
+    return jobs_kill(command->name, SIGTSTP, command->args, command->arg_count);
+}
+int builtin_kill(struct command_t *command)  // sends a signal to jobs (%n) or processes
+{
+    int sig=SIGTERM, first=0;
+    if (command->arg_count>0 && command->args[0][0]=='-') {
+        sig=parse_signal(command->args[0]+1);
+        first=1;
+    }
+    if (sig<0) {
+        fprintf(stderr, "-%s: %s: %s: invalid signal\n", sysname, command->name, command->args[0]+1);
+        return 1;
+    }
+    return jobs_kill(command->name, sig, command->args+first, command->arg_count-first);
+}
+int builtin_alarm(struct command_t *command)  // runs a command or plays a .wav file at the specified time
+{
+    if (command->arg_count==0 || strcmp(command->args[0], "-l")==0) {
+        alarm_list();
+        return 0;
+    }
+    if (strcmp(command->args[0], "-c")==0) {
+        for (int i=1; i<command->arg_count; i++)
+            if (alarm_cancel(atoi(command->args[i]))==-1) {
+                fprintf(stderr, "-%s: %s: %s: no such alarm\n", sysname, command->name, command->args[i]);
+                return 1;
+            }
+        return 0;
+    }
+
+    if (!interactive) {  // only the prompt and foreground waits watch the timer, a script would exit first
+        fprintf(stderr, "-%s: %s: only available in an interactive shell\n", sysname, command->name);
+        return 1;
+    }
+    time_t deadline=alarm_parse_time(command->args[0]);
+    if (deadline==-1 || command->arg_count<2) {
+        fprintf(stderr, "usage: %s HH.MM|+SECONDS file.wav|command [args...]\n", command->name);
+        fprintf(stderr, "       %s [-l] | -c id...\n", command->name);
+        return 1;
+    }
+
+    // the words are already expanded: they are kept as they are, never parsed again
+    const char *file=command->args[1];
+    int n=strlen(file), id;
+    char curdir[PATH_MAX];
+    if (command->arg_count==2 && n>4 && strcmp(file+n-4, ".wav")==0) {  // plays the file like before
+        char *path=file[0]=='/' || getcwd(curdir, sizeof(curdir))==NULL ? strdup(file) : malloc(strlen(curdir)+n+2);
+        if (path!=NULL && path[0]!='/')
+            sprintf(path, "%s/%s", curdir, file);
+        char *argv[]={"aplay", path ? path : (char *)file, NULL};
+        id=alarm_add(deadline, argv, 2);
+        free(path);
+    } else
+        id=alarm_add(deadline, command->args+1, command->arg_count-1);
+
+    char when[32];
+    struct tm tm;
+    localtime_r(&deadline, &tm);
+    strftime(when, sizeof(when), "%H:%M:%S", &tm);
+    printf("alarm %d set for %s\n", id, when);
+    return 0;
+}
+int builtin_history(struct command_t *command)  // custom command 1: shows the last commands, newest first
+{
+    long count=history_count(), n=HISTORY_SIZE;
+    if (command->arg_count>0)
+        n=atol(command->args[0]);
+    for (long i=count-1; i>=0 && i>=count-n; i--) {
+        int len;
+        const char *line=history_get(i, &len);
+        printf("%.*s\n", len, line);
+    }
+    return 0;
+}
+int builtin_wait(struct command_t *command)  // custom command 2: waits for the specified time in seconds
+{
+    if (command->args[0]==NULL) {
+        fprintf(stderr, "No parameters in wait \n");
+        return 1;
+    }
+    int sec=atoi(command->args[0]);
+    sleep(sec);
+    printf("Waited for %d secs\n", sec);
+    return 0;
+}
+int builtin_memstat(struct command_t *command)  // shows the allocation counters of the line arena
+{
+    size_t reserved=0;
+    int chunks=0;
+    for (struct arena_chunk *c=line_arena.chunks; c!=NULL; c=c->next, chunks++)
+        reserved+=c->size;
+    printf("lines parsed:        %ld\n", lines_parsed);
+    printf("arena chunks:        %d (%zu bytes)\n", chunks, reserved);
+    printf("arena mallocs:       %ld\n", line_arena.mallocs);
+    printf("mallocs this line:   %ld\n", line_arena.mallocs_line);
+    printf("bytes this line:     %zu\n", line_arena.used_line);
+    printf("dir cache:           %ld hits, %ld misses\n", dir_cache_hits, dir_cache_misses);
+    return 0;
+}
+int builtin_lshome(struct command_t *command)  // custom command 3: lists the home folder content
+{
+    const char *home=getenv("HOME");
+    if (home==NULL) {
+        fprintf(stderr, "-%s: %s: HOME not set\n", sysname, command->name);
+        return 1;
+    }
+    char *argv[]={"ls", (char *)home, NULL};  // an argument, not a command line: any length, no quoting
+    return launch_wait(argv);
+}
+
+/*
+ * Filter builtins: cat, tee, head and wc -l never run in the shell itself (they
+ * may read the terminal), but as a forked pipeline stage without an exec. Data is
+ * moved by the kernel where the descriptors allow it: copy_file_range() between
+ * regular files, sendfile() out of a regular file, splice() and tee() through
+ * pipes, and read()/write() only as the last resort. Options they do not know
+ * make them exec the real program instead.
+ */
+#define FILTER_CHUNK (1<<20)
+
+enum copy_methods {
+    COPY_FILE_RANGE = 0,
+    COPY_SENDFILE = 1,
+    COPY_SPLICE = 2,
+    COPY_RW = 3,
+};
+/**
+ * Move up to limit bytes from in to out, or everything until EOF when limit is -1
+ * @return bytes copied, -1 with errno set on error
+ */
+long long fd_copy(int in, int out, long long limit)
+{
+    struct stat sin, sout;
+    long long total=0;
+    int method=COPY_RW;
+    if (fstat(in, &sin)==0 && fstat(out, &sout)==0) {
+        if (S_ISREG(sin.st_mode) && S_ISREG(sout.st_mode))
+            method=COPY_FILE_RANGE;
+        else if (S_ISREG(sin.st_mode))
+            method=COPY_SENDFILE;
+        else if (S_ISFIFO(sin.st_mode) || S_ISFIFO(sout.st_mode))
+            method=COPY_SPLICE;
+    }
+
+    static char *buf;
+    while (limit<0 || total<limit) {
+        size_t len=limit<0 || limit-total>FILTER_CHUNK ? FILTER_CHUNK : limit-total;
+        ssize_t n;
+        if (method==COPY_FILE_RANGE)
+            n=copy_file_range(in, NULL, out, NULL, len, 0);
+        else if (method==COPY_SENDFILE)
+            n=sendfile(out, in, NULL, len);
+        else if (method==COPY_SPLICE)
+            n=splice(in, NULL, out, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        else {
+            if (buf==NULL)
+                buf=malloc(FILTER_CHUNK);
+            n=read(in, buf, len);
+            for (ssize_t done=0, w; n>0 && done<n; done+=w)
+                if ((w=write(out, buf+done, n-done))<0) {
+                    if (errno==EINTR) {
+                        w=0;
+                        continue;
+                    }
+                    return -1;
+                }
+        }
+        if (n==0)
+            break;
+        if (n<0) {
+            if (errno==EINTR)
+                continue;
+            // O_APPEND, a terminal, a different file system...: fall back to the next method
+            if (method!=COPY_RW && (errno==EINVAL || errno==EXDEV || errno==ENOSYS
+                                    || errno==EBADF || errno==EOPNOTSUPP)) {
+                method=method==COPY_FILE_RANGE ? COPY_SENDFILE : COPY_RW;
+                continue;
+            }
+            return -1;
+        }
+        total+=n;
+    }
+    return total;
+}
+/**
+ * Run the real program for options a filter builtin does not implement
+ * @return only if the exec failed
+ */
+int filter_fallback(struct command_t *command)
+{
+    const char *path=findPath(command->name);
+    make_argv(command);
+    if (path!=NULL)
+        execv(path, command->args);
+    fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, path ? strerror(errno) : "command not found");
+    return 127;
+}
+/**
+ * Open an input operand, - is stdin
+ * @return the descriptor or -1 after printing the error
+ */
+int filter_open(struct command_t *command, const char *file)
+{
+    if (strcmp(file, "-")==0)
+        return STDIN_FILENO;
+    int fd=open(file, O_RDONLY | O_CLOEXEC);
+    if (fd==-1)
+        fprintf(stderr, "-%s: %s: %s: %s\n", sysname, command->name, file, strerror(errno));
+    return fd;
+}
+int builtin_cat(struct command_t *command)  // copies files or stdin to stdout in the kernel
+{
+    int result=0;
+    for (int i=0; i<command->arg_count; i++)
+        if (command->args[i][0]=='-' && command->args[i][1]!=0)
+            return filter_fallback(command);
+    for (int i=0; i<command->arg_count || i==0; i++) {
+        int fd=command->arg_count ? filter_open(command, command->args[i]) : STDIN_FILENO;
+        if (fd==-1) {
+            result=1;
+            continue;
+        }
+        if (fd_copy(fd, STDOUT_FILENO, -1)==-1) {
+            fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(errno));
+            result=1;
+        }
+        if (fd!=STDIN_FILENO)
+            close(fd);
+    }
+    return result;
+}
+int builtin_tee(struct command_t *command)  // copies stdin to stdout and to files, with tee() when both are pipes
+{
+    int flags=O_WRONLY | O_CREAT | O_CLOEXEC | O_TRUNC;
+    int nfiles=0, result=0;
+    int *fds=arena_alloc(command->arena, sizeof(int)*(command->arg_count+1));
+    for (int i=0; i<command->arg_count; i++) {
+        if (strcmp(command->args[i], "-a")==0)
+            flags=(flags & ~O_TRUNC) | O_APPEND;
+        else if (command->args[i][0]=='-' && command->args[i][1]!=0)
+            return filter_fallback(command);
+    }
+    for (int i=0; i<command->arg_count; i++) {
+        if (command->args[i][0]=='-' && command->args[i][1]!=0)
+            continue;
+        int fd=open(command->args[i], flags, 0666);
+        if (fd==-1) {
+            fprintf(stderr, "-%s: %s: %s: %s\n", sysname, command->name, command->args[i], strerror(errno));
+            result=1;
+        } else
+            fds[nfiles++]=fd;
+    }
+
+    struct stat sin, sout;
+    bool pipes=fstat(STDIN_FILENO, &sin)==0 && S_ISFIFO(sin.st_mode)
+               && fstat(STDOUT_FILENO, &sout)==0 && S_ISFIFO(sout.st_mode);
+    int scratch[2]={-1, -1}, devnull=-1;
+    if (pipes && nfiles>0) {
+        // tee() only duplicates into pipes, so files get their copy through a
+        // scratch pipe as large as stdin; stdin is drained into /dev/null after
+        int size=fcntl(STDIN_FILENO, F_GETPIPE_SZ);
+        if (pipe2(scratch, O_CLOEXEC)==-1 || (devnull=open("/dev/null", O_WRONLY | O_CLOEXEC))==-1
+            || size==-1 || fcntl(scratch[1], F_SETPIPE_SZ, size)<size)  // e.g. over pipe-max-size
+            pipes=false;
+    }
+    char *buf=NULL;
+    if (pipes) {
+        while (1) {
+            ssize_t n=nfiles ? tee(STDIN_FILENO, STDOUT_FILENO, INT_MAX, 0)
+                             : splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, FILTER_CHUNK, SPLICE_F_MOVE);
+            if (n<0 && errno==EINTR)
+                continue;
+            if (n<=0) {
+                if (n<0)
+                    result=1;
+                break;
+            }
+            int f;
+            for (f=0; f<nfiles && fds[f]!=-1; f++) {
+                ssize_t m=tee(STDIN_FILENO, scratch[1], n, 0);
+                if (m!=n) {  // stdin grew past the scratch pipe, or tee() failed
+                    if (m>0)
+                        fd_copy(scratch[0], devnull, m);
+                    break;
+                }
+                for (ssize_t left=m; left>0; ) {
+                    ssize_t s=splice(scratch[0], NULL, fds[f], NULL, left, SPLICE_F_MOVE);
+                    if (s<=0) {  // cannot splice into this file: drop it
+                        fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(s<0 ? errno : EIO));
+                        fd_copy(scratch[0], devnull, left);
+                        close(fds[f]);
+                        fds[f]=fds[--nfiles];
+                        fds[nfiles]=-1;
+                        result=1;
+                        f--;
+                        break;
+                    }
+                    left-=s;
+                }
+            }
+            if (f<nfiles) {  // stdout has the chunk, read it to give it to the other files and go on without tee()
+                buf=malloc(FILTER_CHUNK);
+                for (ssize_t left=n, got; left>0; left-=got) {
+                    got=read(STDIN_FILENO, buf, left<FILTER_CHUNK ? left : FILTER_CHUNK);
+                    if (got<0 && errno==EINTR) {
+                        got=0;
+                        continue;
+                    }
+                    if (got<=0) {
+                        result=1;
+                        break;
+                    }
+                    for (int g=f; g<nfiles; g++)
+                        if (write(fds[g], buf, got)!=got)
+                            result=1;
+                }
+                pipes=false;
+                break;
+            }
+            if (devnull!=-1 && fd_copy(STDIN_FILENO, devnull, n)!=n)  // consume what every sink has seen
+                result=1;
+        }
+    }
+    if (!pipes) {
+        if (buf==NULL)
+            buf=malloc(FILTER_CHUNK);
+        ssize_t n;
+        while ((n=read(STDIN_FILENO, buf, FILTER_CHUNK))>0 || (n<0 && errno==EINTR)) {
+            if (n<0)
+                continue;
+            if (write(STDOUT_FILENO, buf, n)!=n)
+                result=1;
+            for (int f=0; f<nfiles; f++)
+                if (write(fds[f], buf, n)!=n)
+                    result=1;
+        }
+        free(buf);
+    }
+    for (int f=0; f<nfiles; f++)
+        close(fds[f]);
+    if (scratch[0]!=-1) {
+        close(scratch[0]);
+        close(scratch[1]);
+    }
+    if (devnull!=-1)
+        close(devnull);
+    return result;
+}
+/**
+ * Count newlines in the first limit bytes of fd (all of it for -1), stopping
+ * after max lines
+ * @param  bytes   set to the offset just past the last counted newline
+ * @return         number of lines, -1 on a read error
+ */
+long long count_lines(int fd, long long max, long long *bytes)
+{
+    struct stat st;
+    long long lines=0;
+    *bytes=0;
+    if (fstat(fd, &st)==0 && S_ISREG(st.st_mode) && st.st_size>0) {
+        off_t start=lseek(fd, 0, SEEK_CUR);
+        if (start>=0 && start<st.st_size) {  // scan the page cache in place
+            char *map=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map!=MAP_FAILED) {
+                const char *p=map+start, *end=map+st.st_size, *nl;
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                while (lines!=max && (nl=memchr(p, '\n', end-p))!=NULL) {
+                    lines++;
+                    p=nl+1;
+                }
+                *bytes=(lines==max ? p : end)-(map+start);
+                munmap(map, st.st_size);
+                return lines;
+            }
+        }
+    }
+    char *buf=malloc(FILTER_CHUNK);
+    ssize_t n=0;
+    while (lines!=max && ((n=read(fd, buf, FILTER_CHUNK))>0 || (n<0 && errno==EINTR))) {
+        for (char *p=buf, *nl; n>0 && lines!=max && (nl=memchr(p, '\n', buf+n-p))!=NULL; p=nl+1)
+            lines++;
+    }
+    free(buf);
+    return n<0 ? -1 : lines;
+}
+int builtin_head(struct command_t *command)  // prints the first lines (-n) or bytes (-c) of a file
+{
+    long long count=10;
+    bool byte_mode=false;
+    const char *file="-";
+    int files=0;
+    for (int i=0; i<command->arg_count; i++) {
+        char *arg=command->args[i];
+        if ((strcmp(arg, "-n")==0 || strcmp(arg, "-c")==0) && i+1<command->arg_count) {
+            byte_mode=arg[1]=='c';
+            arg=command->args[++i];
+        } else if ((strncmp(arg, "-n", 2)==0 || strncmp(arg, "-c", 2)==0) && arg[2]!=0) {
+            byte_mode=arg[1]=='c';
+            arg+=2;
+        } else if (arg[0]=='-' && arg[1]>='0' && arg[1]<='9')
+            arg++;
+        else if (arg[0]=='-' && arg[1]!=0)
+            return filter_fallback(command);
+        else {
+            file=arg;
+            files++;
+            continue;
+        }
+        char *end;
+        count=strtoll(arg, &end, 10);
+        if (*end!=0 || count<0)  // suffixes like 1K and negative counts are left to the real head
+            return filter_fallback(command);
+    }
+    if (files>1)  // ==> file <== headers
+        return filter_fallback(command);
+
+    int fd=filter_open(command, file);
+    if (fd==-1)
+        return 1;
+    long long len=count;
+    struct stat st;
+    if (!byte_mode) {
+        if (fstat(fd, &st)==0 && S_ISREG(st.st_mode)) {
+            off_t start=lseek(fd, 0, SEEK_CUR);
+            if (count_lines(fd, count, &len)<0) {  // find where line N ends, then copy that many bytes
+                fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(errno));
+                return 1;
+            }
+            lseek(fd, start, SEEK_SET);
+        } else {  // a pipe cannot be rewound: copy line by line through a buffer
+            char *buf=malloc(FILTER_CHUNK);
+            if (buf==NULL) {
+                fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(errno));
+                return 1;
+            }
+            ssize_t n=0;
+            long long lines=0;
+            while (lines<count && ((n=read(fd, buf, FILTER_CHUNK))>0 || (n<0 && errno==EINTR))) {
+                char *p=buf, *nl;
+                if (n<0)
+                    continue;
+                while (lines<count && (nl=memchr(p, '\n', buf+n-p))!=NULL) {
+                    lines++;
+                    p=nl+1;
+                }
+                if (lines<count)
+                    p=buf+n;
+                for (char *q=buf; q<p; ) {
+                    ssize_t w=write(STDOUT_FILENO, q, p-q);
+                    if (w<0 && errno==EINTR)
+                        continue;
+                    if (w<0) {
+                        n=-1;
+                        break;
+                    }
+                    q+=w;
+                }
+                if (n<0)
+                    break;
+            }
+            int err=errno;
+            free(buf);
+            if (n<0) {
+                fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(err));
+                return 1;
+            }
+            return 0;
+        }
+    }
+    int result=fd_copy(fd, STDOUT_FILENO, len)==-1;
+    if (result)
+        fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(errno));
+    return result;
+}
+int builtin_wc(struct command_t *command)  // wc -l: counts lines without copying them out of the kernel where it can
+{
+    const char *file=NULL;
+    bool lines_flag=false;
+    for (int i=0; i<command->arg_count; i++) {
+        if (strcmp(command->args[i], "-l")==0)
+            lines_flag=true;
+        else if (command->args[i][0]=='-' && command->args[i][1]!=0)
+            return filter_fallback(command);
+        else if (file==NULL)
+            file=command->args[i];
+        else
+            return filter_fallback(command);  // several files need a total
+    }
+    if (!lines_flag)
+        return filter_fallback(command);
+
+    int fd=filter_open(command, file ? file : "-");
+    if (fd==-1)
+        return 1;
+    long long bytes, lines=count_lines(fd, -1, &bytes);
+    if (lines<0) {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(errno));
+        return 1;
+    }
+    if (file!=NULL && strcmp(file, "-")!=0)
+        printf("%lld %s\n", lines, file);
+    else
+        printf("%lld\n", lines);
+    return 0;
+}
+
+// keep sorted by name, find_builtin() does a binary search
+const struct builtin_t builtins[]={
+    {":",        builtin_true,     BUILTIN_PARENT | BUILTIN_PIPE},
+    {"[",        builtin_test,     BUILTIN_PARENT | BUILTIN_PIPE},
+    {"alarm",    builtin_alarm,    BUILTIN_PARENT},
+    {"bg",       builtin_bg,       BUILTIN_PARENT},
+    {"bgcapture", builtin_bgcapture, BUILTIN_PARENT},
+    {"break",    builtin_break,    BUILTIN_PARENT},
+    {"cat",      builtin_cat,      BUILTIN_PIPE},
+    {"cd",       builtin_cd,       BUILTIN_PARENT},
+    {"continue", builtin_break,    BUILTIN_PARENT},
+    {"echo",     builtin_echo,     BUILTIN_PARENT | BUILTIN_PIPE},
+    {"exit",     builtin_exit,     BUILTIN_PARENT},
+    {"export",   builtin_export,   BUILTIN_PARENT},
+    {"false",    builtin_false,    BUILTIN_PARENT | BUILTIN_PIPE},
+    {"fg",       builtin_fg,       BUILTIN_PARENT},
+    {"hash",     builtin_hash,     BUILTIN_PARENT | BUILTIN_PIPE},
+    {"head",     builtin_head,     BUILTIN_PIPE},
+    {"history",  builtin_history,  BUILTIN_PARENT | BUILTIN_PIPE},
+    {"joblog",   builtin_joblog,   BUILTIN_PARENT | BUILTIN_PIPE},
+    {"jobs",     builtin_jobs,     BUILTIN_PARENT | BUILTIN_PIPE},
+    {"kill",     builtin_kill,     BUILTIN_PARENT | BUILTIN_PIPE},
+    {"launcher", builtin_launcher, BUILTIN_PARENT | BUILTIN_PIPE},
+    {"lshome",   builtin_lshome,   BUILTIN_PARENT | BUILTIN_PIPE},
+    {"memstat",  builtin_memstat,  BUILTIN_PARENT | BUILTIN_PIPE},
+    {"mybg",     builtin_bg,       BUILTIN_PARENT},
+    {"myfg",     builtin_fg,       BUILTIN_PARENT},
+    {"myjobs",   builtin_jobs,     BUILTIN_PARENT | BUILTIN_PIPE},
+    {"parallel", builtin_parallel, BUILTIN_PIPE},
+    {"pause",    builtin_pause,    BUILTIN_PARENT | BUILTIN_PIPE},
+    {"return",   builtin_return,   BUILTIN_PARENT},
+    {"tee",      builtin_tee,      BUILTIN_PIPE},
+    {"test",     builtin_test,     BUILTIN_PARENT | BUILTIN_PIPE},
+    {"trace",    builtin_trace,    BUILTIN_PARENT},
+    {"true",     builtin_true,     BUILTIN_PARENT | BUILTIN_PIPE},
+    {"unset",    builtin_unset,    BUILTIN_PARENT},
+    {"wait",     builtin_wait,     BUILTIN_PARENT | BUILTIN_PIPE},
+    {"wc",       builtin_wc,       BUILTIN_PIPE},
+};
+
+int compare_builtin(const void *key, const void *entry)
+{
+    return strcmp((const char *)key, ((const struct builtin_t *)entry)->name);
+}
+/**
+ * Look up a builtin command by name
+ * @return the table entry or NULL if name is not a builtin
+ */
+const struct builtin_t *find_builtin(const char *name)
+{
+    return bsearch(name, builtins, sizeof(builtins)/sizeof(builtins[0]),
+                   sizeof(struct builtin_t), compare_builtin);
+}
+
+/*
+ * Command path cache: maps a command name to the absolute path found by walking
+ * $PATH, so every command is looked up at most once. The cache remembers the PATH
+ * it was built against and is flushed as soon as PATH changes.
+ */
+#define HASH_BUCKETS 256
+
+struct hash_entry {
+    char *name;
+    char *path;
+    int hits;
+    struct hash_entry *next;
+};
+struct hash_entry *hash_table[HASH_BUCKETS];
+char *hash_pathvar=NULL;    // value of PATH the cached entries were resolved with
+
+unsigned int hash_string(const char *s)
+{
+    unsigned int h=2166136261u;  // FNV-1a
+    while (*s) {
+        h^=(unsigned char)*s++;
+        h*=16777619u;
+    }
+    return h;
+}
+/**
+ * Drop all cached command paths
+ */
+void hash_flush()
+{
+    for (int i=0; i<HASH_BUCKETS; i++) {
+        struct hash_entry *e=hash_table[i];
+        while (e!=NULL) {
+            struct hash_entry *next=e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e=next;
+        }
+        hash_table[i]=NULL;
+    }
+}
+/**
+ * Flush the cache if PATH was changed since the cached entries were resolved
+ */
+void hash_check_path()
+{
+    const char *pathvar=getenv("PATH");
+    if (pathvar==NULL)
+        pathvar="";
+    if (hash_pathvar==NULL || strcmp(hash_pathvar, pathvar)!=0) {
+        hash_flush();
+        free(hash_pathvar);
+        hash_pathvar=strdup(pathvar);
+    }
+}
+/**
+ * Print the cached commands with their hit counts, like bash's hash builtin
+ */
+void hash_print()
+{
+    hash_check_path();
+    int empty=1;
+    for (int i=0; i<HASH_BUCKETS; i++)
+        for (struct hash_entry *e=hash_table[i]; e!=NULL; e=e->next) {
+            if (empty)
+                printf("hits\tcommand\n");
+            empty=0;
+            printf("%4d\t%s\n", e->hits, e->path);
+        }
+    if (empty)
+        printf("%s: hash table empty\n", sysname);
+}
+/**
+ * Walk the directories of $PATH looking for an executable regular file
+ * @param  cmd command name without any '/'
+ * @return     malloc'ed absolute path or NULL if not found
+ */
+char *search_path(const char *cmd)
+{
+    const char *dirs=getenv("PATH");
+    char candidate[PATH_MAX];
+    struct stat st;
+    if (dirs==NULL)
+        dirs="/usr/local/bin:/usr/bin:/bin";
+
+    while (1) {
+        const char *end=strchr(dirs, ':');
+        int len=end ? end-dirs : (int)strlen(dirs);
+        int n;
+        if (len==0)  // an empty PATH entry means the current directory
+            n=snprintf(candidate, sizeof(candidate), "./%s", cmd);
+        else
+            n=snprintf(candidate, sizeof(candidate), "%.*s/%s", len, dirs, cmd);
+        if (n<(int)sizeof(candidate) && stat(candidate, &st)==0
+                && S_ISREG(st.st_mode) && access(candidate, X_OK)==0)
+            return strdup(candidate);
+        if (end==NULL)
+            return NULL;
+        dirs=end+1;
+    }
+}
+
+const char* findPath(char *cmd) {    // this method finds the path of any command using its name
+    if (cmd==NULL || cmd[0]==0)
+        return NULL;
+    if (strchr(cmd, '/')!=NULL)  // explicit paths like ./a.out or /bin/ls are used as they are
+        return cmd;
+
+    hash_check_path();
+    unsigned int bucket=hash_string(cmd)%HASH_BUCKETS;
+    for (struct hash_entry *e=hash_table[bucket]; e!=NULL; e=e->next)
+        if (strcmp(e->name, cmd)==0) {
+            e->hits++;
+            return e->path;
+        }
+
+    char *path=search_path(cmd);
+    if (path==NULL)
+        return NULL;
+    struct hash_entry *e=malloc(sizeof(struct hash_entry));
+    e->name=strdup(cmd);
+    e->path=path;
+    e->hits=1;
+    e->next=hash_table[bucket];
+    hash_table[bucket]=e;
+    return path;
+}
+
+
+
+/*
+ * Directory listing cache: glob expansion and file name completion read
+ * directories through dir_list(), which keeps the sorted listing of recently used
+ * directories keyed by device and inode. A listing is reused as long as the
+ * directory's mtime has not changed, so a glob over a directory of 100k files
+ * reads it once. A listing taken within a second or two of the last change is
+ * read again next time, because a change in the same clock tick would not move
+ * the mtime.
+ */
+#define DIR_CACHE_SLOTS 64
+
+struct dir_entry {
+    const char *name;
+    unsigned char type;     // d_type, DT_UNKNOWN already resolved with lstat()
+};
+struct dir_listing {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    bool racy;              // too recent to trust the mtime
+    int count;
+    struct dir_entry *entries;  // sorted by name
+    char *names;            // every name, back to back
+};
+struct dir_listing *dir_cache[DIR_CACHE_SLOTS];
+long dir_cache_hits, dir_cache_misses;
+
+int compare_entries(const void *a, const void *b)
+{
+    return strcmp(((const struct dir_entry *)a)->name, ((const struct dir_entry *)b)->name);
+}
+void dir_listing_free(struct dir_listing *listing)
+{
+    if (listing==NULL)
+        return;
+    free(listing->entries);
+    free(listing->names);
+    free(listing);
+}
+/**
+ * Get the entries of a directory, without . and ..
+ * @param  path directory, "" for the current one
+ * @return      the listing, owned by the cache and valid until the next call, or NULL
+ */
+const struct dir_listing *dir_list(const char *path)
+{
+    struct stat st;
+    int fd=open(path[0] ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd==-1)
+        return NULL;
+    if (fstat(fd, &st)==-1) {
+        close(fd);
+        return NULL;
+    }
+    int slot=(st.st_ino*31+st.st_dev)%DIR_CACHE_SLOTS;
+    struct dir_listing *listing=dir_cache[slot];
+    if (listing!=NULL && !listing->racy && listing->dev==st.st_dev && listing->ino==st.st_ino
+        && listing->mtime.tv_sec==st.st_mtim.tv_sec && listing->mtime.tv_nsec==st.st_mtim.tv_nsec) {
+        dir_cache_hits++;
+        close(fd);
+        return listing;
+    }
+    dir_cache_misses++;
+
+    DIR *dir=fdopendir(fd);
+    if (dir==NULL) {
+        close(fd);
+        return NULL;
+    }
+    size_t used=0, size=4096;
+    int cap=64;
+    char *names=malloc(size);
+    struct dir_entry *entries=malloc(sizeof(struct dir_entry)*cap);
+    int count=0;
+    struct dirent *ent;
+    while ((ent=readdir(dir))!=NULL) {
+        if (strcmp(ent->d_name, ".")==0 || strcmp(ent->d_name, "..")==0)
+            continue;
+        size_t len=strlen(ent->d_name)+1;
+        while (used+len>size)
+            names=realloc(names, size*=2);
+        memcpy(names+used, ent->d_name, len);
+        if (count==cap)
+            entries=realloc(entries, sizeof(struct dir_entry)*(cap*=2));
+        entries[count].name=(const char *)used;  // an offset until names stops moving
+        entries[count].type=ent->d_type;
+        struct stat est;
+        if (ent->d_type==DT_UNKNOWN && fstatat(dirfd(dir), ent->d_name, &est, AT_SYMLINK_NOFOLLOW)==0)
+            entries[count].type=S_ISDIR(est.st_mode) ? DT_DIR : S_ISLNK(est.st_mode) ? DT_LNK : DT_REG;
+        count++;
+        used+=len;
+    }
+    closedir(dir);
+    for (int i=0; i<count; i++)
+        entries[i].name=names+(size_t)entries[i].name;
+    qsort(entries, count, sizeof(struct dir_entry), compare_entries);
+
+    dir_listing_free(listing);
+    listing=malloc(sizeof(struct dir_listing));
+    listing->dev=st.st_dev;
+    listing->ino=st.st_ino;
+    listing->mtime=st.st_mtim;
+    listing->racy=time(NULL)-st.st_mtim.tv_sec<2;
+    listing->count=count;
+    listing->entries=entries;
+    listing->names=names;
+    dir_cache[slot]=listing;
+    return listing;
+}
+/**
+ * Tell whether an entry is a directory, following symbolic links
+ * @param  dir directory of the entry, "" for the current one
+ */
+bool dir_entry_isdir(const char *dir, const struct dir_entry *entry)
+{
+    if (entry->type==DT_DIR)
+        return true;
+    if (entry->type!=DT_LNK)
+        return false;
+    struct stat st;
+    char *path=malloc(strlen(dir)+strlen(entry->name)+1);
+    sprintf(path, "%s%s", dir, entry->name);
+    bool isdir=stat(path, &st)==0 && S_ISDIR(st.st_mode);
+    free(path);
+    return isdir;
+}
+
+/*
+ * Glob expansion: words with unquoted *, ? or [...] are patterns, kept with their
+ * quoted special characters escaped, and expanded when the command runs so that
+ * a cd earlier on the line is seen. Every / separated component is matched with
+ * fnmatch() against the cached listing, ** matches any number of directories, and
+ * hidden names only match a pattern that starts with a dot. A pattern without
+ * matches stays as it was written. Results go into an arena vector that doubles,
+ * so hundreds of thousands of paths cost O(n) copies.
+ */
+struct glob_vec {
+    char **v;
+    int n, cap;
+    struct arena_t *arena;
+};
+void glob_push(struct glob_vec *vec, char *s)
+{
+    if (vec->n+1>=vec->cap) {  // room for the NULL at the end
+        int cap=vec->cap ? vec->cap*2 : 16;
+        char **v=arena_alloc(vec->arena, sizeof(char *)*cap);
+        if (vec->n>0)
+            memcpy(v, vec->v, sizeof(char *)*vec->n);
+        vec->v=v;
+        vec->cap=cap;
+    }
+    vec->v[vec->n++]=s;
+}
+/**
+ * Tell whether a pattern has an unescaped *, ? or [
+ */
+bool glob_special(const char *pattern, int len)
+{
+    for (int i=0; i<len; i++) {
+        if (pattern[i]=='\\' && i+1<len)
+            i++;
+        else if (pattern[i]=='*' || pattern[i]=='?' || pattern[i]=='[')
+            return true;
+    }
+    return false;
+}
+/**
+ * Remove the backslashes that escape pattern characters
+ */
+char *glob_unescape(struct arena_t *arena, const char *pattern, int len)
+{
+    char *out=arena_alloc(arena, len+1), *o=out;
+    for (int i=0; i<len; i++) {
+        if (pattern[i]=='\\' && i+1<len)
+            i++;
+        *o++=pattern[i];
+    }
+    *o=0;
+    return out;
+}
+/**
+ * Match the rest of a pattern below a directory prefix
+ * @param prefix path matched so far, "" or ending in '/'
+ * @param rest   remaining components, without leading slashes
+ */
+void glob_walk(struct glob_vec *out, const char *prefix, const char *rest)
+{
+    const char *end=strchr(rest, '/'), *next;
+    int len=end ? end-rest : (int)strlen(rest);
+    bool want_dir=end!=NULL;
+    for (next=rest+len; *next=='/'; next++);
+    size_t plen=strlen(prefix);
+
+    if (!glob_special(rest, len) && !(len==2 && strncmp(rest, "**", 2)==0)) {
+        char *literal=glob_unescape(out->arena, rest, len);
+        char *path=arena_alloc(out->arena, plen+len+2);
+        sprintf(path, "%s%s", prefix, literal);
+        struct stat st;
+        if (*next!=0) {
+            strcat(path, "/");
+            glob_walk(out, path, next);
+        } else if (lstat(path, &st)==0 && (!want_dir || (stat(path, &st)==0 && S_ISDIR(st.st_mode)))) {
+            if (want_dir)
+                strcat(path, "/");
+            glob_push(out, path);
+        }
+        return;
+    }
+
+    const struct dir_listing *listing=dir_list(prefix);
+    if (listing==NULL)
+        return;
+    // the listing can be replaced while we recurse, so take what is needed first
+    int count=listing->count, nmatches=0;
+    char **matches=malloc(sizeof(char *)*(count ? count : 1));
+    bool *dirs=malloc(sizeof(bool)*(count ? count : 1));
+    bool globstar=len==2 && strncmp(rest, "**", 2)==0;
+    char *pattern=strndup(rest, len);
+    for (int i=0; i<count; i++) {
+        const struct dir_entry *e=&listing->entries[i];
+        if (e->name[0]=='.' && rest[0]!='.' && strncmp(rest, "\\.", 2)!=0)
+            continue;
+        if (!globstar && fnmatch(pattern, e->name, 0)!=0)
+            continue;
+        bool isdir=globstar ? e->type==DT_DIR : (want_dir || *next!=0) && dir_entry_isdir(prefix, e);
+        if (!globstar && (want_dir || *next!=0) && !isdir)
+            continue;
+        matches[nmatches]=arena_alloc(out->arena, plen+strlen(e->name)+2);
+        sprintf(matches[nmatches], "%s%s", prefix, e->name);
+        dirs[nmatches++]=isdir;
+    }
+    free(pattern);
+
+    if (globstar && *next!=0)
+        glob_walk(out, prefix, next);  // ** standing for no directory at all
+    for (int i=0; i<nmatches; i++) {
+        char *dir=NULL;
+        if (dirs[i]) {
+            dir=arena_alloc(out->arena, strlen(matches[i])+2);
+            sprintf(dir, "%s/", matches[i]);
+        }
+        if (globstar) {  // every name below, or the rest of the pattern in every directory below
+            if (*next==0 && (!want_dir || dir!=NULL))
+                glob_push(out, want_dir ? dir : matches[i]);
+            if (dir!=NULL)  // symbolic links are not followed, they could loop
+                glob_walk(out, dir, rest);
+        } else if (*next!=0)
+            glob_walk(out, dir, next);
+        else
+            glob_push(out, want_dir ? dir : matches[i]);
+    }
+    free(matches);
+    free(dirs);
+}
+/*
+ * Shell variables and functions. Variables live in a hash table; assigning one
+ * that is in the environment changes the environment instead, so exported
+ * variables stay exported. A function keeps its body parsed in an arena of its
+ * own and every call holds a reference to it, so a function may redefine itself
+ * while it runs.
+ */
+#define VAR_BUCKETS 64
+#define FUNCTION_NEST_MAX 1000
+
+struct var_t {
+    char *name;
+    char *value;
+    size_t cap;         // of value, reused when a loop assigns the variable again
+    struct var_t *next;
+};
+struct var_t *var_table[VAR_BUCKETS];
+struct params_t {
+    int count;
+    char **v;           // $1 is v[0]
+};
+struct params_t params;  // arguments of the running function
+pid_t shell_pid;         // $$, the same in subshells
+
+struct function_t {
+    char *name;
+    struct node_t *body;
+    struct arena_t arena;   // holds the body
+    int refs;               // the table and the calls running it
+    struct function_t *next;
+};
+struct function_t *functions=NULL;
+
+struct var_t **var_slot(const char *name)
+{
+    struct var_t **v=&var_table[hash_string(name)%VAR_BUCKETS];
+    while (*v!=NULL && strcmp((*v)->name, name)!=0)
+        v=&(*v)->next;
+    return v;
+}
+/**
+ * Value of a variable, NULL if it is not set
+ */
+const char *var_get(const char *name)
+{
+    struct var_t *v=*var_slot(name);
+    return v!=NULL ? v->value : getenv(name);
+}
+void var_set(const char *name, const char *value)
+{
+    struct var_t **slot=var_slot(name), *v=*slot;
+    size_t len=strlen(value);
+    if (v==NULL && getenv(name)!=NULL) {  // exported variables stay in the environment
+        setenv(name, value, 1);
+        return;
+    }
+    if (v==NULL) {
+        v=calloc(1, sizeof(struct var_t));
+        v->name=strdup(name);
+        *slot=v;
+    }
+    if (len+1>v->cap) {
+        v->cap=len+1>v->cap*2 ? len+1 : v->cap*2;
+        v->value=realloc(v->value, v->cap);
+    }
+    memcpy(v->value, value, len+1);
+}
+/**
+ * Remove a variable from the shell and from the environment
+ */
+void var_unset(const char *name)
+{
+    struct var_t **slot=var_slot(name), *v=*slot;
+    if (v!=NULL) {
+        *slot=v->next;
+        free(v->name);
+        free(v->value);
+        free(v);
+    }
+    unsetenv(name);
+}
+/**
+ * Value of a parameter: a variable, $0, $1..., $#, $? or $$
+ * @param  buf room for a number
+ * @return     the value, NULL if it is not set
+ */
+const char *param_get(const char *name, char *buf)
+{
+    if (name[0]>='0' && name[0]<='9') {
+        int n=atoi(name);
+        return n==0 ? sysname : n<=params.count ? params.v[n-1] : NULL;
+    }
+    if (strcmp(name, "#")==0)
+        sprintf(buf, "%d", params.count);
+    else if (strcmp(name, "?")==0)
+        sprintf(buf, "%d", last_status);
+    else if (strcmp(name, "$")==0)
+        sprintf(buf, "%d", (int)shell_pid);
+    else
+        return var_get(name);
+    return buf;
+}
+struct function_t *function_find(const char *name)
+{
+    for (struct function_t *f=functions; f!=NULL; f=f->next)
+        if (strcmp(f->name, name)==0)
+            return f;
+    return NULL;
+}
+void function_release(struct function_t *f)
+{
+    if (--f->refs>0)
+        return;
+    arena_free(&f->arena);
+    free(f->name);
+    free(f);
+}
+/**
+ * Take a function out of the table
+ * @return 0, or -1 if there is no such function
+ */
+int function_remove(const char *name)
+{
+    struct function_t **p=&functions;
+    while (*p!=NULL && strcmp((*p)->name, name)!=0)
+        p=&(*p)->next;
+    if (*p==NULL)
+        return -1;
+    struct function_t *f=*p;
+    *p=f->next;
+    function_release(f);
+    return 0;
+}
+/**
+ * Define or redefine a function, parsing its body into the function's arena
+ * @return the exit status of the definition
+ */
+int function_define(const char *name, const char *text)
+{
+    struct function_t *f=calloc(1, sizeof(struct function_t));
+    f->body=parse_line(arena_strdup(&f->arena, text), &f->arena, NULL);
+    if (f->body==NULL) {
+        arena_free(&f->arena);
+        free(f);
+        return 2;
+    }
+    f->name=strdup(name);
+    f->refs=1;
+    function_remove(name);
+    f->next=functions;
+    functions=f;
+    return 0;
+}
+/**
+ * Call a function with the arguments of a stage as its parameters
+ * @param  subshell in the forked child of a pipeline stage, the status is left in last_status
+ * @return          EXIT if the shell should terminate, SUCCESS otherwise
+ */
+int function_call(struct function_t *f, struct command_t *command, bool subshell)
+{
+    if (function_depth>=FUNCTION_NEST_MAX) {
+        fprintf(stderr, "-%s: %s: maximum function nesting level exceeded\n", sysname, f->name);
+        last_status=1;
+        return SUCCESS;
+    }
+    struct params_t saved=params;
+    int code=SUCCESS;
+    params.count=command->arg_count;
+    params.v=command->args;
+    f->refs++;
+    function_depth++;
+    if (subshell)
+        subshell_run(f->body);
+    else
+        code=execute_node(f->body);
+    if (jump==JUMP_RETURN)
+        jump=JUMP_NONE;
+    function_depth--;
+    function_release(f);
+    params=saved;
+    return code;
+}
+
+/*
+ * Command substitution: $(...) and `...` run in a forked copy of the shell whose
+ * stdout is a pipe. The output is read into a buffer that doubles as it grows,
+ * so large outputs cost O(n) copies and no temporary file. Words with a
+ * substitution are kept as typed until the command runs; expand_command() then
+ * substitutes, splits unquoted results on blanks and removes the quotes.
+ */
+/**
+ * Run a command list in a child and collect what it writes to stdout
+ * @param  text the list, NUL terminated
+ * @param  out  the output is appended, without its trailing newlines
+ * @return      0, or -1 if the child could not be started
+ */
+int subst_run(const char *text, struct strbuf *out)
+{
+    int fds[2];
+    sigset_t old;
+    if (pipe2(fds, O_CLOEXEC)==-1) {
+        fprintf(stderr, "-%s: pipe: %s\n", sysname, strerror(errno));
+        return -1;
+    }
+    fflush(stdout);
+    block_sigchld(&old);  // the handler must not reap it, we wait for it here
+    pid_t pid=fork();
+    if (pid==0) {  // like a ( list ) stage, with stdout on the pipe
+        sigset_t mask;
+        struct arena_t arena;
+        memset(&arena, 0, sizeof(arena));
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        for (int i=0; job_signals[i]; i++)
+            signal(job_signals[i], SIG_DFL);
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        zygote_detach();
+        struct node_t *tree=parse_line(arena_strdup(&arena, text), &arena, NULL);
+        int code=tree!=NULL ? subshell_run(tree) : last_status;
+        fflush(stdout);
+        _exit(code);
+    }
+    close(fds[1]);
+    if (pid==-1) {
+        fprintf(stderr, "-%s: fork: %s\n", sysname, strerror(errno));
+        close(fds[0]);
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return -1;
+    }
+    size_t start=out->len;
+    while (1) {
+        strbuf_reserve(out, 4096);
+        ssize_t n=read(fds[0], out->s+out->len, out->cap-out->len);
+        if (n==-1 && errno==EINTR)
+            continue;
+        if (n<=0)
+            break;
+        out->len+=n;
+    }
+    close(fds[0]);
+    int status;
+    while (waitpid(pid, &status, 0)==-1 && errno==EINTR)
+        ;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    last_status=status_code(status);
+    while (out->len>start && out->s[out->len-1]=='\n')
+        out->len--;
+    return 0;
+}
+struct field_state {
+    struct strbuf cur;      // field being built, as a pattern
+    bool started;           // something was added, even an empty quoted string
+    bool split;             // unquoted results are split on blanks, not in assignments
+    bool failed;            // an arithmetic expansion was invalid
+    struct glob_vec *out;
+};
+/**
+ * Add a character to the current field; quoted pattern characters are escaped
+ */
+void field_add(struct field_state *st, char c, bool quoted)
+{
+    if (quoted && strchr("*?[]\\", c)!=NULL)
+        strbuf_add(&st->cur, '\\');
+    strbuf_add(&st->cur, c);
+    st->started=true;
+}
+void field_end(struct field_state *st)
+{
+    if (st->started)
+        glob_push(st->out, arena_strndup(st->out->arena, st->cur.s ? st->cur.s : "", st->cur.len));
+    st->cur.len=0;
+    st->started=false;
+}
+/**
+ * Add the result of an expansion to the fields
+ * @param quoted inside double quotes: no splitting
+ */
+void field_value(struct field_state *st, const char *s, size_t len, bool quoted)
+{
+    for (size_t i=0; i<len; i++) {
+        char c=s[i];
+        if (!quoted && st->split && (c==' ' || c=='\t' || c=='\n'))
+            field_end(st);
+        else
+            field_add(st, c, quoted || c=='\\');
+    }
+    if (quoted)
+        st->started=true;
+}
+/**
+ * Substitute at p, a $( or a backquote, and add the output to the fields
+ * @param  quoted inside double quotes: one field, no splitting
+ * @return        just past the substitution
+ */
+const char *field_subst(struct field_state *st, const char *p, bool quoted)
+{
+    const char *end=subst_skip((char *)p);
+    struct strbuf text={NULL, 0, 0}, output={NULL, 0, 0};
+    if (*p=='`') {  // \`, \\ and \$ are unescaped first
+        for (const char *q=p+1; q<end && *q!='`'; q++) {
+            if (*q=='\\' && (q[1]=='`' || q[1]=='\\' || q[1]=='$'))
+                q++;
+            strbuf_add(&text, *q);
+        }
+    } else {
+        for (const char *q=p+2; q<end && !(q==end-1 && *q==')'); q++)
+            strbuf_add(&text, *q);
+    }
+    strbuf_add(&text, 0);
+    if (subst_run(text.s, &output)==0)
+        field_value(st, output.s, output.len, quoted);
+    else if (quoted)
+        st->started=true;
+    free(text.s);
+    free(output.s);
+    return end;
+}
+/*
+ * Arithmetic expansion: the text of $((...)) is expanded like a double-quoted
+ * string, then evaluated by precedence climbing over long integers. Names are
+ * variables, an unset or empty one is 0.
+ */
+struct arith_t {
+    const char *p;
+    const char *error;  // what went wrong first, NULL while all is well
+};
+struct arith_op {
+    const char *text;
+    int prec;
+};
+const struct arith_op arith_ops[]={  // longest first, they are matched in order
+    {"||", 1}, {"&&", 2}, {"==", 6}, {"!=", 6}, {"<=", 7}, {">=", 7}, {"<<", 8}, {">>", 8},
+    {"|", 3}, {"^", 4}, {"&", 5}, {"<", 7}, {">", 7}, {"+", 9}, {"-", 9}, {"*", 10}, {"/", 10}, {"%", 10},
+    {NULL, 0}
+};
+long arith_binary(struct arith_t *a, int min_prec);
+void arith_space(struct arith_t *a)
+{
+    while (*a->p==' ' || *a->p=='\t' || *a->p=='\n')
+        a->p++;
+}
+/**
+ * Evaluate a number, a name, a parenthesized expression or a unary operator
+ */
+long arith_unary(struct arith_t *a)
+{
+    char c, name[256];
+    arith_space(a);
+    c=*a->p;
+    if (c=='-' || c=='+' || c=='!' || c=='~') {
+        a->p++;
+        long v=arith_unary(a);
+        return c=='-' ? (long)-(unsigned long)v : c=='!' ? !v : c=='~' ? ~v : v;
+    }
+    if (c=='(') {
+        a->p++;
+        long v=arith_binary(a, 1);
+        arith_space(a);
+        if (*a->p!=')' && a->error==NULL)
+            a->error="missing )";
+        a->p+=*a->p==')';
+        return v;
+    }
+    if (c>='0' && c<='9') {
+        char *end;
+        long v=strtol(a->p, &end, 0);
+        a->p=end;
+        return v;
+    }
+    int len=name_length(a->p);
+    if (len==0 || len>=(int)sizeof(name)) {
+        if (a->error==NULL)
+            a->error="syntax error";
+        return 0;
+    }
+    memcpy(name, a->p, len);
+    name[len]=0;
+    a->p+=len;
+    const char *value=var_get(name);
+    return value!=NULL ? strtol(value, NULL, 0) : 0;
+}
+long arith_binary(struct arith_t *a, int min_prec)
+{
+    long left=arith_unary(a);
+    while (a->error==NULL) {
+        const struct arith_op *op;
+        arith_space(a);
+        for (op=arith_ops; op->text!=NULL; op++)
+            if (strncmp(a->p, op->text, strlen(op->text))==0)
+                break;
+        if (op->text==NULL || op->prec<min_prec)
+            break;
+        a->p+=strlen(op->text);
+        long right=arith_binary(a, op->prec+1);
+        unsigned long l=left, r=right;  // + - * wrap around instead of overflowing
+        switch (op->text[0]*256+op->text[1]) {
+        case '|'*256+'|': left=left || right; break;
+        case '&'*256+'&': left=left && right; break;
+        case '='*256+'=': left=left==right; break;
+        case '!'*256+'=': left=left!=right; break;
+        case '<'*256+'=': left=left<=right; break;
+        case '>'*256+'=': left=left>=right; break;
+        case '<'*256+'<': left=l<<(r & 63); break;
+        case '>'*256+'>': left=left>>(r & 63); break;
+        case '|'*256: left=left | right; break;
+        case '^'*256: left=left ^ right; break;
+        case '&'*256: left=left & right; break;
+        case '<'*256: left=left<right; break;
+        case '>'*256: left=left>right; break;
+        case '+'*256: left=l+r; break;
+        case '-'*256: left=l-r; break;
+        case '*'*256: left=l*r; break;
+        default:  // / and %
+            if (right==0)
+                a->error="division by 0";
+            else if (right==-1)
+                left=op->text[0]=='/' ? -l : 0;
+            else
+                left=op->text[0]=='/' ? left/right : left%right;
+        }
+    }
+    return left;
+}
+/**
+ * Evaluate $((...)) at p and add the number to the fields
+ * @return just past the expansion
+ */
+const char *field_arith(struct field_state *st, const char *p, bool quoted)
+{
+    const char *end=subst_skip((char *)p);
+    char num[32];
+    if (end-p<5 || end[-1]!=')' || end[-2]!=')') {
+        fprintf(stderr, "-%s: %.*s: missing ))\n", sysname, (int)(end-p), p);
+        st->failed=true;
+        return end;
+    }
+    struct strbuf expr={NULL, 0, 0};  // "text", quotes inside it only end and restart the string
+    strbuf_add(&expr, '"');
+    strbuf_append(&expr, p+3, end-p-5);
+    strbuf_append(&expr, "\"", 2);
+    char *text=word_expand_string(st->out->arena, expr.s);
+    free(expr.s);
+    if (text==NULL) {
+        st->failed=true;
+        return end;
+    }
+    struct arith_t a={text, NULL};
+    long value=arith_binary(&a, 1);
+    arith_space(&a);
+    if (a.error==NULL && *a.p!=0)
+        a.error="syntax error";
+    if (a.error!=NULL) {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, text, a.error);
+        st->failed=true;
+    } else {
+        int len=sprintf(num, "%ld", value);
+        field_value(st, num, len, quoted);
+    }
+    return end;
+}
+/**
+ * Expand the parameter at p: $name, ${name}, $1, $#, $?, $$, $@, $* or $((...))
+ * @param  quoted inside double quotes: no splitting, and "$@" gives one field per parameter
+ * @return        just past the parameter
+ */
+const char *field_param(struct field_state *st, const char *p, bool quoted)
+{
+    char name[256], num[32];
+    const char *from=p+1, *end;
+    if (p[1]=='(')
+        return field_arith(st, p, quoted);
+    if (p[1]=='{') {
+        from=p+2;
+        end=strchr(from, '}');
+        if (end==NULL) {  // not a parameter, the $ is a character
+            field_add(st, '$', quoted);
+            return p+1;
+        }
+        int digits=strspn(from, "0123456789");
+        bool valid=end>from && (name_length(from)==end-from || digits==end-from
+                                || (end-from==1 && strchr("#?$@*", *from)!=NULL));
+        if (!valid) {  // ${x:-word}, ${#x} and the like are not supported
+            fprintf(stderr, "-%s: ${%.*s}: bad substitution\n", sysname, (int)(end-from), from);
+            st->failed=true;
+            return end+1;
+        }
+    } else {
+        int len=name_length(from);
+        end=from+(len>0 ? len : 1);
+    }
+    int len=end-from<(int)sizeof(name) ? end-from : (int)sizeof(name)-1;
+    memcpy(name, from, len);
+    name[len]=0;
+    end+=p[1]=='{';
+    if (strcmp(name, "@")==0 || strcmp(name, "*")==0) {
+        for (int i=0; i<params.count; i++) {
+            if (i>0 && quoted && name[0]=='@')
+                field_end(st);
+            else if (i>0)
+                field_value(st, " ", 1, quoted);
+            field_value(st, params.v[i], strlen(params.v[i]), quoted);
+        }
+        if (quoted && (params.count>0 || name[0]=='*'))
+            st->started=true;
+        return end;
+    }
+    const char *value=param_get(name, num);
+    if (value!=NULL)
+        field_value(st, value, strlen(value), quoted);
+    else if (quoted)
+        st->started=true;
+    return end;
+}
+/**
+ * Expand a word kept as typed into fields
+ * @param  out   the fields, as patterns with quoted special characters escaped
+ * @param  split split unquoted results into several fields
+ * @return       0, or -1 after printing the error of an arithmetic expansion
+ */
+int word_expand(struct glob_vec *out, const char *word, bool split)
+{
+    struct field_state st={{NULL, 0, 0}, false, split, false, out};
+    const char *p=word;
+    while (*p!=0) {
+        if (*p=='\\' && p[1]!=0) {
+            field_add(&st, p[1], true);
+            p+=2;
+        } else if (*p=='\'') {
+            for (p++; *p!=0 && *p!='\''; p++)
+                field_add(&st, *p, true);
+            st.started=true;
+            p+=*p!=0;
+        } else if (*p=='"') {
+            for (p++; *p!=0 && *p!='"';) {
+                if (*p=='\\' && p[1]!=0 && strchr("\"\\$`", p[1])!=NULL) {
+                    field_add(&st, p[1], true);
+                    p+=2;
+                } else if (param_start(p))
+                    p=field_param(&st, p, true);
+                else if ((*p=='$' && p[1]=='(') || *p=='`')
+                    p=field_subst(&st, p, true);
+                else
+                    field_add(&st, *p++, true);
+            }
+            st.started=true;
+            p+=*p!=0;
+        } else if (param_start(p))
+            p=field_param(&st, p, false);
+        else if ((*p=='$' && p[1]=='(') || *p=='`')
+            p=field_subst(&st, p, false);
+        else
+            field_add(&st, *p++, false);
+    }
+    field_end(&st);
+    free(st.cur.s);
+    return st.failed ? -1 : 0;
+}
+/**
+ * Expand the value of an assignment into one string, without splitting or patterns
+ * @return the value allocated in the arena, NULL after an error
+ */
+char *word_expand_string(struct arena_t *arena, const char *word)
+{
+    struct glob_vec fields={NULL, 0, 0, arena};
+    if (word_expand(&fields, word, false)==-1)
+        return NULL;
+    if (fields.n==0)
+        return arena_strdup(arena, "");
+    return glob_unescape(arena, fields.v[0], strlen(fields.v[0]));
+}
+/**
+ * Expand one pattern into the matching paths, sorted, or the pattern itself
+ */
+void expand_pattern(struct glob_vec *out, char *word)
+{
+    int first=out->n;
+    if (!glob_special(word, strlen(word))) {
+        glob_push(out, glob_unescape(out->arena, word, strlen(word)));
+        return;
+    }
+    if (word[0]=='/') {
+        const char *rest=word;
+        while (*rest=='/')
+            rest++;
+        glob_walk(out, "/", rest);
+    } else
+        glob_walk(out, "", word);
+    if (out->n==first)  // no match: the word itself
+        glob_push(out, glob_unescape(out->arena, word, strlen(word)));
+    else
+        qsort(out->v+first, out->n-first, sizeof(char *), compare_names);
+}
+/**
+ * Expand the substitutions and patterns of a stage in place: the name,
+ * the arguments and the redirection targets
+ * @return 0, or -1 after printing the error
+ */
+int expand_command(struct command_t *command)
+{
+    struct arena_t *arena=command->arena;
+    for (struct redirect_t *r=command->redirects; r!=NULL; r=r->next) {
+        if (!r->raw)
+            continue;
+        struct glob_vec fields={NULL, 0, 0, arena};
+        if (word_expand(&fields, r->target, true)==-1)
+            return -1;
+        if (fields.n!=1) {
+            fprintf(stderr, "-%s: %s: ambiguous redirect\n", sysname, r->target);
+            return -1;
+        }
+        r->target=glob_unescape(arena, fields.v[0], strlen(fields.v[0]));
+        r->raw=false;
+    }
+    if (command->expand==NULL && !command->name_raw)
+        return 0;
+
+    struct glob_vec out={NULL, 0, 0, arena};
+    bool name_raw=command->name_raw;
+    if (name_raw) {  // the first field is the name, the others come before the arguments
+        struct glob_vec fields={NULL, 0, 0, arena};
+        if (word_expand(&fields, command->name, true)==-1)
+            return -1;
+        for (int i=0; i<fields.n; i++)
+            glob_push(&out, glob_unescape(arena, fields.v[i], strlen(fields.v[i])));
+        command->name_raw=false;
+    }
+    for (int i=0; i<command->arg_count; i++) {
+        char *word=command->args[i];
+        int expand=command->expand ? command->expand[i] : EXPAND_NONE;
+        if (expand==EXPAND_GLOB)
+            expand_pattern(&out, word);
+        else if (expand==EXPAND_RAW) {
+            struct glob_vec fields={NULL, 0, 0, arena};
+            if (word_expand(&fields, word, true)==-1)
+                return -1;
+            for (int f=0; f<fields.n; f++)
+                expand_pattern(&out, fields.v[f]);
+        } else
+            glob_push(&out, word);
+    }
+    if (out.v==NULL)
+        out.v=arena_alloc(arena, sizeof(char *));
+    out.v[out.n]=NULL;
+    command->args=out.v;
+    command->arg_count=out.n;
+    command->expand=NULL;
+    if (name_raw) {  // an empty substitution as the name leaves the next word as the command
+        command->name=out.n>0 ? out.v[0] : "";
+        command->args+=out.n>0;
+        command->arg_count-=out.n>0;
+    }
+    return 0;
+}
+
+/*
+ * Tab completion index: the executables of every $PATH directory are kept in a
+ * sorted in-memory list. A directory is only read again when its mtime changes,
+ * so a Tab press costs one stat() per PATH entry plus a binary search.
+ */
+struct comp_dir {
+    char *path;
+    struct timespec mtime;
+    int count;
+    char **names;   // sorted executable names
+};
+struct comp_dir *comp_dirs=NULL;
+int comp_ndirs=0;
+char *comp_pathvar=NULL;    // value of PATH the directory list was built from
+
+int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+void comp_free_names(struct comp_dir *d)
+{
+    for (int i=0; i<d->count; i++)
+        free(d->names[i]);
+    free(d->names);
+    d->names=NULL;
+    d->count=0;
+}
+/**
+ * Re-read a PATH directory if it changed since it was indexed
+ * @param d [description]
+ */
+void comp_refresh_dir(struct comp_dir *d)
+{
+    struct stat st;
+    if (stat(d->path, &st)==-1) {
+        comp_free_names(d);
+        return;
+    }
+    if (d->names!=NULL && st.st_mtim.tv_sec==d->mtime.tv_sec && st.st_mtim.tv_nsec==d->mtime.tv_nsec)
+        return;  // unchanged since the last scan
+
+    comp_free_names(d);
+    d->mtime=st.st_mtim;
+    DIR *dir=opendir(d->path);
+    if (dir==NULL)
+        return;
+    int cap=64;
+    d->names=malloc(sizeof(char *)*cap);
+    struct dirent *ent;
+    while ((ent=readdir(dir))!=NULL) {
+        if (ent->d_name[0]=='.')
+            continue;
+        if (ent->d_type!=DT_REG && ent->d_type!=DT_LNK && ent->d_type!=DT_UNKNOWN)
+            continue;
+        if (faccessat(dirfd(dir), ent->d_name, X_OK, 0)==-1)
+            continue;
+        if (d->count==cap) {
+            cap*=2;
+            d->names=realloc(d->names, sizeof(char *)*cap);
+        }
+        d->names[d->count++]=strdup(ent->d_name);
+    }
+    closedir(dir);
+    qsort(d->names, d->count, sizeof(char *), compare_names);
+}
+/**
+ * Rebuild the directory list when PATH changed, keeping already indexed directories
+ */
+void comp_check_path()
+{
+    const char *pathvar=getenv("PATH");
+    if (pathvar==NULL)
+        pathvar="";
+    if (comp_pathvar!=NULL && strcmp(comp_pathvar, pathvar)==0)
+        return;
+
+    struct comp_dir *old=comp_dirs;
+    int nold=comp_ndirs;
+    comp_dirs=NULL;
+    comp_ndirs=0;
+    const char *dirs=pathvar;
+    while (1) {
+        const char *end=strchr(dirs, ':');
+        int len=end ? end-dirs : (int)strlen(dirs);
+        char *path=len ? strndup(dirs, len) : strdup(".");
+        int j;
+        for (j=0; j<nold; j++)
+            if (old[j].path!=NULL && strcmp(old[j].path, path)==0)
+                break;
+        comp_dirs=realloc(comp_dirs, sizeof(struct comp_dir)*(comp_ndirs+1));
+        if (j<nold) {  // reuse the index of a directory that is still in PATH
+            comp_dirs[comp_ndirs]=old[j];
+            old[j].path=NULL;
+            free(path);
+        } else {
+            memset(&comp_dirs[comp_ndirs], 0, sizeof(struct comp_dir));
+            comp_dirs[comp_ndirs].path=path;
+        }
+        comp_ndirs++;
+        if (end==NULL)
+            break;
+        dirs=end+1;
+    }
+    for (int j=0; j<nold; j++)
+        if (old[j].path!=NULL) {
+            comp_free_names(&old[j]);
+            free(old[j].path);
+        }
+    free(old);
+    free(comp_pathvar);
+    comp_pathvar=strdup(pathvar);
+}
+/**
+ * Collect the executables in PATH starting with prefix
+ * @param  prefix  [description]
+ * @param  matches set to a malloc'ed, sorted and duplicate free array of names owned by the index
+ * @return         number of matches
+ */
+int comp_commands(const char *prefix, const char ***matches)
+{
+    int count=0, cap=16, plen=strlen(prefix);
+    const char **found=malloc(sizeof(char *)*cap);
+    comp_check_path();
+    for (int i=0; i<comp_ndirs; i++) {
+        struct comp_dir *d=&comp_dirs[i];
+        comp_refresh_dir(d);
+        int lo=0, hi=d->count;
+        while (lo<hi) {  // first name not smaller than the prefix
+            int mid=(lo+hi)/2;
+            if (strcmp(d->names[mid], prefix)<0)
+                lo=mid+1;
+            else
+                hi=mid;
+        }
+        for (; lo<d->count && strncmp(d->names[lo], prefix, plen)==0; lo++) {
+            if (count==cap) {
+                cap*=2;
+                found=realloc(found, sizeof(char *)*cap);
+            }
+            found[count++]=d->names[lo];
+        }
+    }
+    qsort(found, count, sizeof(char *), compare_names);
+    int unique=0;
+    for (int i=0; i<count; i++)  // the same command may live in several PATH directories
+        if (unique==0 || strcmp(found[unique-1], found[i])!=0)
+            found[unique++]=found[i];
+    *matches=found;
+    return unique;
+}
+/**
+ * Collect the file names starting with word, which may include a directory part
+ * @param  word    [description]
+ * @param  matches set to a malloc'ed, sorted array of malloc'ed paths, directories end in '/'
+ * @return         number of matches
+ */
+int comp_files(const char *word, char ***matches)
+{
+    int count=0, cap=16;
+    char **found=malloc(sizeof(char *)*cap);
+    const char *slash=strrchr(word, '/');
+    const char *base=slash ? slash+1 : word;
+    int dirlen=slash ? slash-word+1 : 0;
+    int blen=strlen(base);
+    char *dirpath=strndup(word, dirlen);
+
+    const struct dir_listing *listing=dir_list(dirpath);
+    for (int i=0; listing!=NULL && i<listing->count; i++) {
+        const struct dir_entry *ent=&listing->entries[i];
+        if (strncmp(ent->name, base, blen)!=0)
+            continue;
+        if (ent->name[0]=='.' && base[0]!='.')  // hidden files only when asked for
+            continue;
+        int isdir=dir_entry_isdir(dirpath, ent);
+        if (count==cap) {
+            cap*=2;
+            found=realloc(found, sizeof(char *)*cap);
+        }
+        found[count]=malloc(dirlen+strlen(ent->name)+2);
+        sprintf(found[count++], "%.*s%s%s", dirlen, word, ent->name, isdir ? "/" : "");
+    }
+    free(dirpath);
+    qsort(found, count, sizeof(char *), compare_names);
+    *matches=found;
+    return count;
+}
+/**
+ * Handle a Tab press. The last word of the line is completed against PATH when it is
+ * the command name and against file names otherwise. If there is only one match
+ * the completed command is run immediately, if there are more they are listed.
+ * If the command name is already fully typed the current directory is listed.
+ * @param  command parsed line whose last word ends with '?'
+ * @return         1 if the completed command should be run, 0 otherwise
+ */
+int autocomplete(struct command_t *command)
+{
+    struct command_t *last=command;
+    while (last->next!=NULL)
+        last=last->next;
+    command->auto_complete=false;
+
+    char **word=last->arg_count>0 ? &last->args[last->arg_count-1] : &last->name;
+    int len=strlen(*word);
+    if (len>0 && (*word)[len-1]=='?')
+        (*word)[--len]=0;
+
+    if (word==&last->name && strchr(*word, '/')==NULL) {
+        const char **names;
+        int n=comp_commands(*word, &names);
+        if (n==1 && strcmp(names[0], *word)==0) {  // fully typed, list the current directory
+            char **files;
+            int nfiles=comp_files("", &files);
+            printf("\n");
+            for (int i=0; i<nfiles; i++) {
+                printf("%s\n", files[i]);
+                free(files[i]);
+            }
+            free(files);
+            free(names);
+            return 0;
+        }
+        printf("\n");
+        for (int i=0; i<n; i++)
+            printf("%s\n", names[i]);
+        printf("\n");
+        if (n==1)  // if there is only one item in the list it is being executed
+            *word=arena_strdup(last->arena, names[0]);
+        free(names);
+        return n==1;
+    }
+
+    char **files;
+    int n=comp_files(*word, &files);
+    printf("\n");
+    for (int i=0; i<n; i++)
+        printf("%s\n", files[i]);
+    printf("\n");
+    if (n==1)
+        *word=arena_strdup(last->arena, files[0]);
+    for (int i=0; i<n; i++)
+        free(files[i]);
+    free(files);
+    if (word!=&last->name && last->arg_count>0 && (*word)[0]==0)  // a lone '?' is not an argument
+        last->args[--last->arg_count]=NULL;
+    return n==1;
+}
+/**
+ * Turn the parsed arguments into an execv() argument vector:
+ * args[0] becomes a copy of the name and the vector stays NULL terminated
+ * @param command [description]
+ */
+void make_argv(struct command_t *command)
+{
+    char **argv=arena_alloc(command->arena, sizeof(char *)*(command->arg_count+2));
+
+    // set args[0] to the name and shift everything forward by 1
+    argv[0]=command->name;
+    memcpy(argv+1, command->args, sizeof(char *)*command->arg_count);
+    command->arg_count++;
+    // set the last one to NULL
+    argv[command->arg_count]=NULL;
+    command->args=argv;
+}
+/*
+ * Resource control: rctl is a per-stage prefix, like nice or taskset, except that
+ * nothing extra is executed. The options are parsed in the shell and applied in
+ * the forked child right before the exec, so each stage of a pipeline can get its
+ * own CPU set, niceness, limits and cgroup:
+ *   rctl -c 0 producer | rctl -c 1 consumer
+ */
+#define RCTL_MAX_LIMITS 8
+
+struct rctl_limit {
+    int resource;
+    struct rlimit value;
+};
+struct rctl_t {
+    bool has_cpus;
+    cpu_set_t cpus;             // sched_setaffinity()
+    bool has_nice;
+    int nice;                   // setpriority(), absolute
+    int nlimits;
+    struct rctl_limit limits[RCTL_MAX_LIMITS];  // setrlimit(), soft and hard
+    const char *cgroup;         // cgroup v2 directory the child moves itself into
+};
+
+struct rctl_resource {
+    const char *name;
+    int resource;
+};
+const struct rctl_resource rctl_resources[]={
+    {"as", RLIMIT_AS},
+    {"core", RLIMIT_CORE},
+    {"cpu", RLIMIT_CPU},
+    {"data", RLIMIT_DATA},
+    {"fsize", RLIMIT_FSIZE},
+    {"memlock", RLIMIT_MEMLOCK},
+    {"nofile", RLIMIT_NOFILE},
+    {"nproc", RLIMIT_NPROC},
+    {"stack", RLIMIT_STACK},
+    {NULL, 0},
+};
+
+/**
+ * Parse a CPU list like 0-3,6
+ * @param  spec [description]
+ * @param  set  filled with the CPUs
+ * @return      0 on success, -1 if the list is malformed
+ */
+int rctl_parse_cpus(const char *spec, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *p=spec;
+    while (*p) {
+        char *end;
+        long first=strtol(p, &end, 10), last;
+        if (end==p || first<0 || first>=CPU_SETSIZE)
+            return -1;
+        last=first;
+        if (*end=='-') {
+            p=end+1;
+            last=strtol(p, &end, 10);
+            if (end==p || last<first || last>=CPU_SETSIZE)
+                return -1;
+        }
+        for (long cpu=first; cpu<=last; cpu++)
+            CPU_SET(cpu, set);
+        if (*end==',')
+            end++;
+        else if (*end!=0)
+            return -1;
+        p=end;
+    }
+    return CPU_COUNT(set)>0 ? 0 : -1;
+}
+/**
+ * Parse a byte count with an optional K, M or G suffix
+ * @param  s     [description]
+ * @param  value set to the count
+ * @return       0 on success, -1 if s is not a size
+ */
+int parse_size(const char *s, unsigned long long *value)
+{
+    char *end;
+    errno=0;
+    *value=strtoull(s, &end, 10);
+    if (end==s || errno!=0 || s[0]=='-')
+        return -1;
+    switch (*end) {
+    case 'G': case 'g': *value<<=10; // fall through
+    case 'M': case 'm': *value<<=10; // fall through
+    case 'K': case 'k': *value<<=10; end++; break;
+    }
+    return *end==0 ? 0 : -1;
+}
+/**
+ * Parse a limit like as=512M, nofile=64 or core=unlimited
+ * @param  spec  [description]
+ * @param  limit filled in
+ * @return       0 on success, -1 if the resource or the value is unknown
+ */
+int rctl_parse_limit(const char *spec, struct rctl_limit *limit)
+{
+    const char *eq=strchr(spec, '=');
+    if (eq==NULL)
+        return -1;
+    const struct rctl_resource *r=rctl_resources;
+    while (r->name!=NULL && (strlen(r->name)!=(size_t)(eq-spec) || strncmp(r->name, spec, eq-spec)!=0))
+        r++;
+    if (r->name==NULL)
+        return -1;
+    limit->resource=r->resource;
+    if (strcmp(eq+1, "unlimited")==0) {
+        limit->value.rlim_cur=limit->value.rlim_max=RLIM_INFINITY;
+        return 0;
+    }
+    unsigned long long value;
+    if (parse_size(eq+1, &value)==-1)
+        return -1;
+    limit->value.rlim_cur=limit->value.rlim_max=value;
+    return 0;
+}
+/**
+ * Strip the rctl prefix from a stage and keep its options on the command:
+ * rctl [-c cpus] [-n nice] [-l resource=value]... [-g cgroup] [--] command args
+ * @param  command the stage, its name is rctl
+ * @return         0 on success, -1 after printing the error
+ */
+int rctl_parse(struct command_t *command)
+{
+    struct rctl_t *rctl=arena_alloc(command->arena, sizeof(struct rctl_t));
+    memset(rctl, 0, sizeof(struct rctl_t));
+    int i=0;
+    for (; i<command->arg_count; i++) {
+        const char *opt=command->args[i], *value=i+1<command->arg_count ? command->args[i+1] : NULL;
+        if (strcmp(opt, "--")==0) {
+            i++;
+            break;
+        }
+        if (opt[0]!='-')
+            break;
+        if (strlen(opt)!=2 || strchr("cnlg", opt[1])==NULL || i+1>=command->arg_count) {
+            fprintf(stderr, "-%s: rctl: usage: rctl [-c cpus] [-n nice] [-l resource=value]... [-g cgroup] command\n", sysname);
+            return -1;
+        }
+        i++;
+        char *end;
+        switch (opt[1]) {
+        case 'c':
+            if (rctl_parse_cpus(value, &rctl->cpus)==-1) {
+                fprintf(stderr, "-%s: rctl: %s: invalid CPU list\n", sysname, value);
+                return -1;
+            }
+            rctl->has_cpus=true;
+            break;
+        case 'n':
+            rctl->nice=strtol(value, &end, 10);
+            if (end==value || *end!=0) {
+                fprintf(stderr, "-%s: rctl: %s: invalid niceness\n", sysname, value);
+                return -1;
+            }
+            rctl->has_nice=true;
+            break;
+        case 'l':
+            if (rctl->nlimits==RCTL_MAX_LIMITS || rctl_parse_limit(value, &rctl->limits[rctl->nlimits])==-1) {
+                fprintf(stderr, "-%s: rctl: %s: invalid limit\n", sysname, value);
+                return -1;
+            }
+            rctl->nlimits++;
+            break;
+        case 'g':
+            rctl->cgroup=value;
+            break;
+        }
+    }
+    if (i>=command->arg_count) {
+        fprintf(stderr, "-%s: rctl: no command\n", sysname);
+        return -1;
+    }
+    command->name=command->args[i];
+    command->args+=i+1;
+    command->arg_count-=i+1;
+    command->rctl=rctl;
+    return 0;
+}
+/**
+ * Apply the limits to the calling process, in the child between fork and exec
+ * @param  rctl [description]
+ * @param  name the command, for error messages
+ * @return      0 on success, -1 after printing the error
+ */
+int rctl_apply(const struct rctl_t *rctl, const char *name)
+{
+    if (rctl->cgroup!=NULL) {  // first, so the limits below are charged to the new group
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s/cgroup.procs",
+                 rctl->cgroup[0]=='/' ? "" : "/sys/fs/cgroup/", rctl->cgroup);
+        int fd=open(path, O_WRONLY | O_CLOEXEC);
+        if (fd==-1 || dprintf(fd, "%d\n", getpid())<0) {
+            fprintf(stderr, "-%s: %s: %s: %s\n", sysname, name, path, strerror(errno));
+            return -1;
+        }
+        close(fd);
+    }
+    if (rctl->has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &rctl->cpus)==-1) {
+        fprintf(stderr, "-%s: %s: sched_setaffinity: %s\n", sysname, name, strerror(errno));
+        return -1;
+    }
+    if (rctl->has_nice && setpriority(PRIO_PROCESS, 0, rctl->nice)==-1) {
+        fprintf(stderr, "-%s: %s: setpriority: %s\n", sysname, name, strerror(errno));
+        return -1;
+    }
+    for (int i=0; i<rctl->nlimits; i++)
+        if (setrlimit(rctl->limits[i].resource, &rctl->limits[i].value)==-1) {
+            fprintf(stderr, "-%s: %s: setrlimit: %s\n", sysname, name, strerror(errno));
+            return -1;
+        }
+    return 0;
+}
+/*
+ * Launch layer: every external command is started through launch(). The default
+ * uses posix_spawn(), which glibc implements with a vfork-style clone so the
+ * shell's page tables are never copied; redirections and pipes become spawn file
+ * actions. The old fork()+execv() path and a pre-started zygote process are kept
+ * selectable for comparison with the launcher builtin or SHELLGIBI_LAUNCH.
+ */
+enum launch_modes {
+    LAUNCH_SPAWN = 0,
+    LAUNCH_FORK = 1,
+    LAUNCH_ZYGOTE = 2,
+};
+#define LAUNCH_MODES 3
+const char *launch_names[LAUNCH_MODES]={"spawn", "fork", "zygote"};
+int launch_mode=LAUNCH_SPAWN;
+
+struct launch_stat {
+    long count;
+    double total_us;
+    double max_us;
+};
+struct launch_stat launch_stats[LAUNCH_MODES];
+
+// signals the interactive shell ignores or handles, children get their defaults back
+const int job_signals[]={SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD, 0};
+
+#define REDIRECT_FD_MIN 10  // redirections name descriptors 0-9, the shell keeps its own above
+
+struct fd_action {
+    int fd;             // descriptor in the child
+    int source;         // dup2()ed onto fd, -1 closes fd
+    bool owned;         // opened for this stage, the parent closes it after the launch
+};
+struct launch_t {
+    const char *path;
+    char **argv;        // prepared in the parent, NULL terminated
+    const struct rctl_t *rctl;  // NULL, or limits to apply in the child: forces the fork path
+    pid_t pgid;         // process group to join, 0 to lead a new one, -1 to stay in the shell's
+    int fds[3];         // descriptors to install as stdin/stdout/stderr, -1 keeps the shell's
+    struct fd_action *actions;  // redirections, applied in order after fds
+    int nactions;
+};
+
+double elapsed_us(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec-start->tv_sec)*1e6+(now.tv_nsec-start->tv_nsec)/1e3;
+}
+/**
+ * Pick the launch mode from the environment
+ */
+void launch_init()
+{
+    const char *mode=getenv("SHELLGIBI_LAUNCH");
+    if (mode!=NULL)
+        launch_select(mode);
+}
+/**
+ * Change the launch mode, or reset the statistics with -r
+ * @param  mode spawn, fork, zygote or -r
+ * @return      0 on success, -1 for an unknown mode, -2 if the zygote did not start
+ */
+int launch_select(const char *mode)
+{
+    if (strcmp(mode, "-r")==0) {
+        memset(launch_stats, 0, sizeof(launch_stats));
+        return 0;
+    }
+    for (int i=0; i<LAUNCH_MODES; i++)
+        if (strcmp(mode, launch_names[i])==0) {
+            if (i==LAUNCH_ZYGOTE && zygote_start()==-1)
+                return -2;
+            launch_mode=i;
+            return 0;
+        }
+    return -1;
+}
+/**
+ * Print the current mode and how long the shell was blocked starting commands in each mode
+ */
+void launch_report()
+{
+    printf("mode: %s\n", launch_names[launch_mode]);
+    for (int i=0; i<LAUNCH_MODES; i++) {
+        struct launch_stat *st=&launch_stats[i];
+        if (st->count==0)
+            continue;
+        printf("%-6s launches: %ld  avg: %.1f us  max: %.1f us\n", launch_names[i],
+               st->count, st->total_us/st->count, st->max_us);
+    }
+}
+/**
+ * Apply redirection actions in order, in a forked child or in the shell itself
+ * @return 0 on success, -1 after printing the error
+ */
+int fd_actions_apply(const struct fd_action *actions, int n)
+{
+    for (int i=0; i<n; i++) {
+        const struct fd_action *a=&actions[i];
+        int result=a->source==-1 ? close(a->fd)
+                   : a->source==a->fd ? fcntl(a->fd, F_SETFD, 0)
+                   : dup2(a->source, a->fd);
+        if (result==-1 && a->source!=-1) {
+            fprintf(stderr, "-%s: %d: %s\n", sysname, a->source, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+/**
+ * Install the stage's descriptors in a forked child, like the spawn file actions do
+ * @return 0 on success, -1 after printing the error
+ */
+int launch_apply_fds(const struct launch_t *l)
+{
+    for (int i=0; i<3; i++)
+        if (l->fds[i]!=-1 && l->fds[i]!=i)
+            dup2(l->fds[i], i);
+    return fd_actions_apply(l->actions, l->nactions);
+}
+/*
+ * Zygote: with SHELLGIBI_LAUNCH=zygote or `launcher zygote` a helper is started
+ * by re-executing the shell binary, so it has none of the shell's history, caches
+ * or terminal state. launch() sends it the path, argv, environment and the
+ * redirection plan over a SOCK_SEQPACKET socket, with the descriptors and the
+ * working directory attached as SCM_RIGHTS. The zygote creates the command with
+ * clone(CLONE_PARENT | CLONE_VM | CLONE_VFORK): the child belongs to the shell,
+ * which reaps it and moves it between process groups exactly like the ones it
+ * forked itself, and the zygote replies once the exec is done.
+ */
+#define ZYGOTE_MAX_FDS 32
+#define ZYGOTE_MSG_MAX (128*1024)
+
+struct zygote_request {
+    pid_t pgid;         // as in launch_t
+    int nactions;       // struct zygote_action follow, then the strings
+    int argc;           // path, argv and the environment, each NUL terminated
+    int envc;
+};
+struct zygote_action {
+    int fd;             // descriptor in the child
+    int source;         // index of the passed descriptor to dup2(), -1 closes fd
+};
+
+int zygote_fd=-1;       // the shell's end of the socket, -1 when no zygote runs
+pid_t zygote_pid=-1;
+char *zygote_buf=NULL;  // request being built, reused by every launch
+size_t zygote_buf_cap=0;
+
+/**
+ * Start the zygote if it is not running yet
+ * @return 0 on success, -1 after printing the error
+ */
+int zygote_start()
+{
+    if (zygote_fd!=-1)
+        return 0;
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)==-1) {
+        fprintf(stderr, "-%s: zygote: %s\n", sysname, strerror(errno));
+        return -1;
+    }
+    pid_t pid=fork();  // before the exec the copy is thrown away, nothing runs in it
+    if (pid==0) {
+        char fdarg[16];
+        char *argv[]={"shellgibi-zygote", "--zygote", fdarg, NULL};
+        snprintf(fdarg, sizeof(fdarg), "%d", sv[1]);
+        fcntl(sv[1], F_SETFD, 0);
+        execv("/proc/self/exe", argv);
+        _exit(127);
+    }
+    close(sv[1]);
+    if (pid==-1) {
+        fprintf(stderr, "-%s: zygote: %s\n", sysname, strerror(errno));
+        close(sv[0]);
+        return -1;
+    }
+    zygote_fd=sv[0];
+    zygote_pid=pid;
+    return 0;
+}
+/**
+ * Drop the zygote in a forked copy of the shell: children the zygote creates belong
+ * to the original shell, so a subshell or a builtin stage has to start its own
+ */
+void zygote_detach()
+{
+    if (zygote_fd!=-1)
+        close(zygote_fd);
+    zygote_fd=-1;
+    if (launch_mode==LAUNCH_ZYGOTE)
+        launch_mode=LAUNCH_SPAWN;
+}
+/**
+ * Append to the request buffer, growing it by doubling
+ * @return 0 on success, -1 if the request would be too large
+ */
+int zygote_append(size_t *len, const void *data, size_t n)
+{
+    if (*len+n>ZYGOTE_MSG_MAX)
+        return -1;
+    if (*len+n>zygote_buf_cap) {
+        size_t cap=zygote_buf_cap ? zygote_buf_cap : 4096;
+        while (cap<*len+n)
+            cap*=2;
+        zygote_buf=realloc(zygote_buf, cap);
+        zygote_buf_cap=cap;
+    }
+    memcpy(zygote_buf+*len, data, n);
+    *len+=n;
+    return 0;
+}
+/**
+ * Have the zygote start a command
+ * @param  l [description]
+ * @return   pid of the child or -1 with errno set; zygote_fd is -1 afterwards if
+ *           the zygote is gone and the caller should start the command itself
+ */
+pid_t zygote_launch(const struct launch_t *l)
+{
+    struct zygote_request req={l->pgid, 0, 0, 0};
+    struct zygote_action acts[3+ZYGOTE_MAX_FDS];
+    int fds[ZYGOTE_MAX_FDS], nfds=0;
+    size_t len=0;
+
+    int cwd=open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd==-1)
+        return -1;
+    fds[nfds++]=cwd;  // always first, the child fchdir()s to it
+    for (int i=0; i<3; i++) {  // the zygote's own 0-2 may be stale, always send the shell's
+        acts[req.nactions].fd=i;
+        acts[req.nactions++].source=nfds;
+        fds[nfds++]=l->fds[i]!=-1 ? l->fds[i] : i;
+    }
+    for (int i=0; i<l->nactions && nfds<ZYGOTE_MAX_FDS; i++) {
+        acts[req.nactions].fd=l->actions[i].fd;
+        acts[req.nactions++].source=l->actions[i].source==-1 ? -1 : nfds;
+        if (l->actions[i].source!=-1)
+            fds[nfds++]=l->actions[i].source;
+    }
+    int ok=req.nactions==3+l->nactions;
+    for (req.argc=0; l->argv[req.argc]!=NULL; req.argc++)
+        ;
+    for (req.envc=0; environ[req.envc]!=NULL; req.envc++)
+        ;
+    ok=ok && zygote_append(&len, &req, sizeof(req))==0
+       && zygote_append(&len, acts, sizeof(struct zygote_action)*req.nactions)==0
+       && zygote_append(&len, l->path, strlen(l->path)+1)==0;
+    for (int i=0; ok && i<req.argc; i++)
+        ok=zygote_append(&len, l->argv[i], strlen(l->argv[i])+1)==0;
+    for (int i=0; ok && i<req.envc; i++)
+        ok=zygote_append(&len, environ[i], strlen(environ[i])+1)==0;
+    if (!ok) {
+        close(cwd);
+        errno=E2BIG;
+        return -1;
+    }
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int)*ZYGOTE_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov={zygote_buf, len};
+    struct msghdr msg={.msg_iov=&iov, .msg_iovlen=1,
+                       .msg_control=control.buf, .msg_controllen=CMSG_SPACE(sizeof(int)*nfds)};
+    struct cmsghdr *cmsg=CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level=SOL_SOCKET;
+    cmsg->cmsg_type=SCM_RIGHTS;
+    cmsg->cmsg_len=CMSG_LEN(sizeof(int)*nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int)*nfds);
+
+    ssize_t n;
+    int reply=0;
+    while ((n=sendmsg(zygote_fd, &msg, MSG_NOSIGNAL))==-1 && errno==EINTR)
+        ;
+    close(cwd);
+    if (n!=-1)
+        while ((n=recv(zygote_fd, &reply, sizeof(reply), 0))==-1 && errno==EINTR)
+            ;
+    if (n<=0) {
+        fprintf(stderr, "-%s: zygote: exited, starting commands with fork\n", sysname);
+        close(zygote_fd);
+        zygote_fd=-1;
+        launch_mode=LAUNCH_FORK;
+        return -1;
+    }
+    if (reply<0) {
+        errno=-reply;
+        return -1;
+    }
+    return reply;
+}
+struct zygote_child {
+    const struct zygote_request *req;
+    const struct zygote_action *acts;
+    const int *fds;
+    char *path, **argv, **envp;
+    char prefix[256];   // "-shellgibi: name: ", formatted before the clone for the exec error
+};
+char zygote_stack[64*1024];  // the zygote is suspended while a child runs on it
+
+/**
+ * Runs in the child, on the zygote's memory until the exec like posix_spawn()
+ * @param  arg the struct zygote_child
+ * @return     never, the child execs or exits
+ */
+int zygote_exec(void *arg)
+{
+    const struct zygote_child *c=arg;
+    sigset_t mask;
+    if (c->req->pgid!=-1)
+        setpgid(0, c->req->pgid);
+    for (int i=0; job_signals[i]; i++)
+        signal(job_signals[i], SIG_DFL);
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    fchdir(c->fds[0]);
+    for (int i=0; i<c->req->nactions; i++) {
+        const struct zygote_action *a=&c->acts[i];
+        if (a->source==-1)
+            close(a->fd);
+        else if (c->fds[a->source]==a->fd)
+            fcntl(a->fd, F_SETFD, 0);
+        else if (dup2(c->fds[a->source], a->fd)==-1)
+            _exit(1);
+    }
+    execve(c->path, c->argv, c->envp);
+    const char *reason=strerrordesc_np(errno);  // a table lookup: stdio and strerror() may lock or allocate
+    if (reason==NULL)
+        reason="cannot execute";
+    struct iovec msg[]={
+        {(void *)c->prefix, strlen(c->prefix)},
+        {(void *)reason, strlen(reason)},
+        {"\n", 1},
+    };
+    writev(STDERR_FILENO, msg, 3);
+    _exit(127);
+}
+/**
+ * Main loop of the zygote process: one request, one child, one reply
+ * @param  fd the zygote's end of the socket
+ * @return    exit status once the shell is gone
+ */
+int zygote_main(int fd)
+{
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    prctl(PR_SET_NAME, "sg-zygote");
+    if (getppid()==1)
+        return 0;
+    for (int i=0; job_signals[i]; i++)  // the terminal's job-control signals are for the shell's jobs
+        if (job_signals[i]!=SIGCHLD)
+            signal(job_signals[i], SIG_IGN);
+    char *buf=malloc(ZYGOTE_MSG_MAX);
+    while (1) {
+        union {
+            char buf[CMSG_SPACE(sizeof(int)*ZYGOTE_MAX_FDS)];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov={buf, ZYGOTE_MSG_MAX};
+        struct msghdr msg={.msg_iov=&iov, .msg_iovlen=1,
+                           .msg_control=control.buf, .msg_controllen=sizeof(control.buf)};
+        ssize_t n=recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n==-1 && errno==EINTR)
+            continue;
+        if (n<=0)
+            return 0;
+
+        int fds[ZYGOTE_MAX_FDS], nfds=0;
+        for (struct cmsghdr *c=CMSG_FIRSTHDR(&msg); c!=NULL; c=CMSG_NXTHDR(&msg, c))
+            if (c->cmsg_level==SOL_SOCKET && c->cmsg_type==SCM_RIGHTS) {
+                nfds=(c->cmsg_len-CMSG_LEN(0))/sizeof(int);
+                memcpy(fds, CMSG_DATA(c), sizeof(int)*nfds);
+            }
+        for (int i=0; i<nfds; i++) {  // out of the way of the descriptors the child installs
+            int moved=fcntl(fds[i], F_DUPFD_CLOEXEC, REDIRECT_FD_MIN);
+            close(fds[i]);
+            fds[i]=moved;
+        }
+
+        struct zygote_request *req=(struct zygote_request *)buf;
+        struct zygote_action *acts=(struct zygote_action *)(req+1);
+        char *p=(char *)(acts+req->nactions);
+        char *path=p, **argv=malloc(sizeof(char *)*(req->argc+req->envc+2)), **envp=argv+req->argc+1;
+        p+=strlen(p)+1;
+        for (int i=0; i<req->argc; i++, p+=strlen(p)+1)
+            argv[i]=p;
+        argv[req->argc]=NULL;
+        for (int i=0; i<req->envc; i++, p+=strlen(p)+1)
+            envp[i]=p;
+        envp[req->envc]=NULL;
+
+        struct zygote_child child={req, acts, fds, path, argv, envp, ""};
+        snprintf(child.prefix, sizeof(child.prefix), "-%s: %s: ", sysname, argv[0]);
+        int reply=clone(zygote_exec, zygote_stack+sizeof(zygote_stack),
+                        CLONE_VM | CLONE_VFORK | CLONE_PARENT | SIGCHLD, &child);
+        if (reply==-1)
+            reply=-errno;
+        free(argv);
+        for (int i=0; i<nfds; i++)
+            close(fds[i]);
+        send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+    }
+}
+/**
+ * Start an external command with the current launch mode. Every descriptor the
+ * shell creates for children is close-on-exec, so only the dup2()s are needed.
+ * @param  l [description]
+ * @return   pid of the child or -1 with errno set
+ */
+pid_t launch(struct launch_t *l)
+{
+    struct timespec start;
+    pid_t pid;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int mode=l->rctl!=NULL ? LAUNCH_FORK : launch_mode;  // posix_spawn() has no hook before the exec
+    if (mode==LAUNCH_ZYGOTE) {
+        pid=zygote_launch(l);
+        if (pid==-1 && zygote_fd!=-1)
+            return -1;
+        if (pid==-1)
+            mode=LAUNCH_FORK;  // the zygote is gone, start this one ourselves
+    }
+    if (mode==LAUNCH_SPAWN) {
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        sigset_t defaults, mask;
+        posix_spawn_file_actions_init(&actions);
+        for (int i=0; i<3; i++)
+            if (l->fds[i]!=-1 && l->fds[i]!=i)
+                posix_spawn_file_actions_adddup2(&actions, l->fds[i], i);
+        for (int i=0; i<l->nactions; i++)
+            if (l->actions[i].source==-1)
+                posix_spawn_file_actions_addclose(&actions, l->actions[i].fd);
+            else
+                posix_spawn_file_actions_adddup2(&actions, l->actions[i].source, l->actions[i].fd);
+        posix_spawnattr_init(&attr);
+        sigemptyset(&defaults);
+        for (int i=0; job_signals[i]; i++)
+            sigaddset(&defaults, job_signals[i]);
+        sigemptyset(&mask);
+        posix_spawnattr_setsigdefault(&attr, &defaults);
+        posix_spawnattr_setsigmask(&attr, &mask);
+        posix_spawnattr_setpgroup(&attr, l->pgid);
+        posix_spawnattr_setflags(&attr, (l->pgid!=-1 ? POSIX_SPAWN_SETPGROUP : 0) | POSIX_SPAWN_SETSIGDEF
+                                 | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_USEVFORK);
+        int err=posix_spawn(&pid, l->path, &actions, &attr, l->argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+        if (err!=0) {
+            errno=err;
+            return -1;
+        }
+    } else if (mode==LAUNCH_FORK) {
+        pid=fork();
+        if (pid==-1)
+            return -1;
+        if (pid==0) {
+            sigset_t mask;
+            if (l->pgid!=-1)
+                setpgid(0, l->pgid);
+            for (int i=0; job_signals[i]; i++)
+                signal(job_signals[i], SIG_DFL);
+            sigemptyset(&mask);
+            sigprocmask(SIG_SETMASK, &mask, NULL);
+            if (launch_apply_fds(l)==-1)
+                _exit(1);
+            if (l->rctl!=NULL && rctl_apply(l->rctl, l->argv[0])==-1)
+                _exit(126);
+            execv(l->path, l->argv);
+            fprintf(stderr, "-%s: %s: %s\n", sysname, l->argv[0], strerror(errno));
+            _exit(127);
+        }
+    }
+    if (l->pgid!=-1)
+        setpgid(pid, l->pgid ? l->pgid : pid);  // also done here so the group exists before we wait on it
+
+    double us=elapsed_us(&start);
+    struct launch_stat *st=&launch_stats[mode];
+    st->count++;
+    st->total_us+=us;
+    if (us>st->max_us)
+        st->max_us=us;
+    return pid;
+}
+/**
+ * Run an external command in the foreground of the shell and wait for it, for
+ * builtins that are front ends to another program
+ * @param  argv the command and its arguments, NULL terminated
+ * @return      its exit status, 127 if it is not found
+ */
+int launch_wait(char **argv)
+{
+    struct launch_t l={.path=findPath(argv[0]), .argv=argv, .pgid=-1, .fds={-1, -1, -1}};
+    sigset_t old;
+    int status;
+    if (l.path==NULL) {
+        fprintf(stderr, "-%s: %s: command not found\n", sysname, argv[0]);
+        return 127;
+    }
+    fflush(stdout);
+    block_sigchld(&old);  // the handler must not reap it, we wait for it here
+    pid_t pid=launch(&l);
+    if (pid==-1) {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, argv[0], strerror(errno));
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return 126;
+    }
+    while (waitpid(pid, &status, 0)==-1 && errno==EINTR)
+        ;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return status_code(status);
+}
+/*
+ * Job control: every pipeline the shell starts is a job with its own process
+ * group. The SIGCHLD handler reaps children with waitpid(WNOHANG) and records
+ * their state in the job table; the rest of the shell only touches the table
+ * with SIGCHLD blocked. fg/bg/jobs/kill work on it with tcsetpgrp() and kill().
+ */
+#define MAX_JOBS 64
+
+enum job_states {
+    JOB_RUNNING = 0,
+    JOB_STOPPED = 1,
+    JOB_DONE = 2,
+};
+const char *job_state_names[]={"Running", "Stopped", "Done"};
+
+struct job_timing {  // microseconds since the epoch
+    double spawn;   // before the stage was started
+    double exec;    // launch() returned: exec done with posix_spawn, fork done otherwise
+    double reap;    // reaped by the SIGCHLD handler
+};
+
+struct job_t {
+    int id;
+    pid_t pgid;
+    int nprocs;
+    pid_t *pids;
+    int *states;    // job_states of every process
+    int *status;    // raw wait status of every process
+    struct rusage *usage;           // resource usage of every finished process, from wait4()
+    struct job_timing *timing;      // when every process was started and reaped
+    int state;
+    bool background;
+    char *cmdline;
+    struct capture_t *capture;  // where a background job's output goes, NULL for the terminal
+};
+struct job_t *jobs[MAX_JOBS];   // jobs[id-1]
+int job_current=0;              // id of the job fg/bg act on by default
+pid_t shell_pgid;
+struct rusage last_usage;       // summed over the processes of the last foreground job
+
+/**
+ * Job control setup for an interactive shell: put the shell in its own process
+ * group in the foreground and ignore the terminal's job-control signals
+ */
+void jobs_init()
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler=sigchld_handler;
+    sa.sa_flags=SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    if (!interactive)
+        return;
+    signal(SIGINT, signal_interrupt);  // not ignored, the prompt receives them through its signalfd
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, signal_noop);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN); // so that we can take the terminal back from finished jobs
+    shell_pgid=getpid();
+    setpgid(0, shell_pgid);
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+}
+void block_sigchld(sigset_t *old)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, old);
+}
+/**
+ * Convert a wait status into a shell exit code
+ */
+int status_code(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSTOPPED(status))
+        return 128+WSTOPSIG(status);
+    return 128+WTERMSIG(status);
+}
+/**
+ * Wall-clock time in microseconds, safe to call from the SIGCHLD handler
+ */
+double wall_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec*1e6+now.tv_nsec/1e3;
+}
+/**
+ * Record a state change reported by wait4() in the job owning pid
+ */
+void job_update(pid_t pid, int status, const struct rusage *usage)
+{
+    for (int i=0; i<MAX_JOBS; i++) {
+        struct job_t *job=jobs[i];
+        if (job==NULL)
+            continue;
+        for (int p=0; p<job->nprocs; p++) {
+            if (job->pids[p]!=pid)
+                continue;
+            if (WIFSTOPPED(status))
+                job->states[p]=JOB_STOPPED;
+            else if (WIFCONTINUED(status))
+                job->states[p]=JOB_RUNNING;
+            else {
+                job->states[p]=JOB_DONE;
+                job->status[p]=status;
+                job->usage[p]=*usage;
+                job->timing[p].reap=wall_us();
+            }
+
+            int running=0, stopped=0;
+            for (int q=0; q<job->nprocs; q++) {
+                running+=job->states[q]==JOB_RUNNING;
+                stopped+=job->states[q]==JOB_STOPPED;
+            }
+            job->state=running ? JOB_RUNNING : stopped ? JOB_STOPPED : JOB_DONE;
+            return;
+        }
+    }
+}
+/**
+ * Reap every child that changed state. Runs in the SIGCHLD handler, or with SIGCHLD blocked.
+ */
+void job_reap()
+{
+    pid_t pid;
+    int status;
+    struct rusage usage;
+    while ((pid=wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage))>0)
+        job_update(pid, status, &usage);
+}
+void sigchld_handler(int sig)
+{
+    int saved_errno=errno;
+    job_reap();
+    errno=saved_errno;
+}
+/**
+ * Add a job to the table. Must be called with SIGCHLD blocked.
+ * @return the new job, or NULL if the table is full
+ */
+struct job_t *job_add(pid_t pgid, pid_t *pids, int nprocs, const char *cmdline, bool background)
+{
+    int i;
+    for (i=0; i<MAX_JOBS && jobs[i]!=NULL; i++);
+    if (i==MAX_JOBS)
+        return NULL;
+    struct job_t *job=malloc(sizeof(struct job_t));
+    job->id=i+1;
+    job->pgid=pgid;
+    job->nprocs=nprocs;
+    job->pids=malloc(sizeof(pid_t)*nprocs);
+    memcpy(job->pids, pids, sizeof(pid_t)*nprocs);
+    job->states=calloc(nprocs, sizeof(int));
+    job->status=calloc(nprocs, sizeof(int));
+    job->usage=calloc(nprocs, sizeof(struct rusage));
+    job->timing=calloc(nprocs, sizeof(struct job_timing));
+    job->state=JOB_RUNNING;
+    job->background=background;
+    job->cmdline=strdup(cmdline);
+    job->capture=NULL;
+    jobs[i]=job;
+    return job;
+}
+/**
+ * Remove a job from the table. Must be called with SIGCHLD blocked.
+ */
+void job_free(struct job_t *job)
+{
+    if (trace_fd!=-1)
+        trace_job(job);
+    jobs[job->id-1]=NULL;
+    if (job->capture!=NULL)  // the output stays readable with joblog
+        capture_finish(job->capture);
+    if (job_current==job->id)
+        job_current=0;
+    free(job->pids);
+    free(job->states);
+    free(job->status);
+    free(job->usage);
+    free(job->timing);
+    free(job->cmdline);
+    free(job);
+}
+/**
+ * Pipefail exit status of a finished job: the rightmost failure wins
+ */
+int job_status(struct job_t *job)
+{
+    int result=0;
+    for (int p=0; p<job->nprocs; p++) {
+        int code=status_code(job->status[p]);
+        if (code!=0)
+            result=code;
+    }
+    return result;
+}
+/**
+ * Add up the resource usage of the processes of a job; maxrss is the largest one
+ */
+void job_usage(struct job_t *job, struct rusage *sum)
+{
+    memset(sum, 0, sizeof(*sum));
+    for (int p=0; p<job->nprocs; p++) {
+        struct rusage *u=&job->usage[p];
+        timeradd(&sum->ru_utime, &u->ru_utime, &sum->ru_utime);
+        timeradd(&sum->ru_stime, &u->ru_stime, &sum->ru_stime);
+        if (u->ru_maxrss>sum->ru_maxrss)
+            sum->ru_maxrss=u->ru_maxrss;
+        sum->ru_nvcsw+=u->ru_nvcsw;
+        sum->ru_nivcsw+=u->ru_nivcsw;
+    }
+}
+void job_print(struct job_t *job)
+{
+    printf("[%d]%c  %-8s %s\n", job->id, job->id==job_current ? '+' : ' ',
+           job_state_names[job->state], job->cmdline);
+}
+/**
+ * Report background jobs that finished since the last prompt and drop them from the table
+ */
+void job_notify()
+{
+    sigset_t old;
+    block_sigchld(&old);
+    for (int i=0; i<MAX_JOBS; i++)
+        if (jobs[i]!=NULL && jobs[i]->state==JOB_DONE) {
+            if (interactive)  // scripts drop finished jobs silently
+                job_print(jobs[i]);
+            job_free(jobs[i]);
+        }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+/**
+ * Check for background jobs that job_notify() would report
+ */
+bool job_notify_pending()
+{
+    for (int i=0; i<MAX_JOBS; i++)
+        if (jobs[i]!=NULL && jobs[i]->state==JOB_DONE)
+            return true;
+    return false;
+}
+/**
+ * Give the terminal to a job and wait until it finishes or stops.
+ * Must be called with SIGCHLD blocked.
+ * @return exit status of the job
+ */
+int job_wait_fg(struct job_t *job)
+{
+    sigset_t waitmask;
+    sigprocmask(SIG_SETMASK, NULL, &waitmask);
+    sigdelset(&waitmask, SIGCHLD);
+
+    job->background=false;
+    if (interactive)
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    while (job->state==JOB_RUNNING)
+        capture_wait(&waitmask);  // the SIGCHLD handler updates the job
+    if (interactive)
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+
+    if (job->state==JOB_STOPPED) {
+        job->background=true;
+        job_current=job->id;
+        printf("\n");
+        job_print(job);
+        for (int p=0; p<job->nprocs; p++)
+            if (job->states[p]==JOB_STOPPED)
+                return status_code(job->status[p] ? job->status[p] : W_STOPCODE(SIGTSTP));
+        return 128+SIGTSTP;
+    }
+    int result=job_status(job);
+    job_usage(job, &last_usage);
+    job_free(job);
+    return result;
+}
+/**
+ * Find the job named by a job spec (%n, %%, %+) or, when allow_pid is set, by the pid of one of its processes
+ * @param  spec NULL for the current job
+ * @return      the job or NULL
+ */
+struct job_t *job_find(const char *spec, bool allow_pid)
+{
+    int id=job_current;
+    if (spec!=NULL && spec[0]=='%') {
+        if (spec[1]!=0 && strcmp(spec, "%%")!=0 && strcmp(spec, "%+")!=0)
+            id=atoi(spec+1);
+    } else if (spec!=NULL) {
+        pid_t pid=atoi(spec);
+        if (!allow_pid)
+            id=pid;
+        else {
+            for (int i=0; i<MAX_JOBS; i++)
+                if (jobs[i]!=NULL)
+                    for (int p=0; p<jobs[i]->nprocs; p++)
+                        if (pid>0 && jobs[i]->pids[p]==pid)  // 0 is a stage that never started
+                            return jobs[i];
+            return NULL;
+        }
+    }
+    if (id==0) {  // no current job: take the most recent one
+        for (int i=MAX_JOBS-1; i>=0; i--)
+            if (jobs[i]!=NULL)
+                return jobs[i];
+        return NULL;
+    }
+    if (id<1 || id>MAX_JOBS)
+        return NULL;
+    return jobs[id-1];
+}
+/**
+ * Send a signal to every process of a job. Scripts do not give jobs their
+ * own process group, so there the processes are signalled one by one.
+ * @return 0 on success, -1 with errno set otherwise
+ */
+int job_signal(struct job_t *job, int sig)
+{
+    if (interactive)
+        return kill(-job->pgid, sig);
+    int result=-1;
+    errno=ESRCH;
+    for (int p=0; p<job->nprocs; p++)
+        if (job->states[p]!=JOB_DONE && kill(job->pids[p], sig)==0)
+            result=0;
+    return result;
+}
+/**
+ * Resume a job in the foreground (fg, myfg) or in the background (bg, mybg)
+ * @return exit status
+ */
+int job_continue(const char *name, const char *spec, bool foreground, bool allow_pid)
+{
+    sigset_t old;
+    int result=0;
+    block_sigchld(&old);
+    struct job_t *job=job_find(spec, allow_pid);
+    if (job==NULL) {
+        if (allow_pid && spec!=NULL && spec[0]!='%' && kill(atoi(spec), SIGCONT)==0) {
+            sigprocmask(SIG_SETMASK, &old, NULL);  // not one of ours, all we can do is continue it
+            return 0;
+        }
+        fprintf(stderr, "-%s: %s: %s: no such job\n", sysname, name, spec ? spec : "current");
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return 1;
+    }
+    printf("%s\n", job->cmdline);
+    if (foreground && interactive)
+        tcsetpgrp(STDIN_FILENO, job->pgid);  // before SIGCONT so it can read the terminal right away
+    if (job_signal(job, SIGCONT)==-1)
+        fprintf(stderr, "-%s: %s: %s\n", sysname, name, strerror(errno));
+    for (int p=0; p<job->nprocs; p++)
+        if (job->states[p]==JOB_STOPPED)
+            job->states[p]=JOB_RUNNING;
+    if (job->state==JOB_STOPPED)
+        job->state=JOB_RUNNING;
+    if (foreground)
+        result=job_wait_fg(job);
+    else {
+        job->background=true;
+        job_current=job->id;
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return result;
+}
+/**
+ * List the job table
+ */
+void jobs_list()
+{
+    sigset_t old;
+    block_sigchld(&old);
+    for (int i=0; i<MAX_JOBS; i++)
+        if (jobs[i]!=NULL) {
+            job_print(jobs[i]);
+            if (jobs[i]->state==JOB_DONE)
+                job_free(jobs[i]);
+        }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+/**
+ * Send a signal to jobs (%n) or processes (pid)
+ * @param  sig    signal to send
+ * @param  argv   targets
+ * @param  argc   number of targets
+ * @return        exit status
+ */
+int jobs_kill(const char *name, int sig, char **argv, int argc)
+{
+    int result=0;
+    for (int i=0; i<argc; i++) {
+        pid_t target;
+        if (argv[i][0]=='%') {
+            sigset_t old;
+            block_sigchld(&old);
+            struct job_t *job=job_find(argv[i], false);
+            int sent=job ? job_signal(job, sig) : 0;
+            sigprocmask(SIG_SETMASK, &old, NULL);
+            if (job==NULL) {
+                fprintf(stderr, "-%s: %s: %s: no such job\n", sysname, name, argv[i]);
+                result=1;
+            } else if (sent==-1) {
+                fprintf(stderr, "-%s: %s: %s: %s\n", sysname, name, argv[i], strerror(errno));
+                result=1;
+            }
+            continue;
+        } else
+            target=atoi(argv[i]);
+        if (target==0 || kill(target, sig)==-1) {
+            fprintf(stderr, "-%s: %s: %s: %s\n", sysname, name, argv[i], target ? strerror(errno) : "invalid target");
+            result=1;
+        }
+    }
+    return result;
+}
+/**
+ * Parse a signal given as -9, -KILL or -SIGKILL
+ * @return signal number or -1
+ */
+int parse_signal(const char *arg)
+{
+    static const struct { const char *name; int sig; } names[]={
+        {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+        {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"TERM", SIGTERM}, {"CONT", SIGCONT},
+        {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}, {"ALRM", SIGALRM}, {"PIPE", SIGPIPE},
+    };
+    if (arg[0]>='0' && arg[0]<='9')
+        return atoi(arg);
+    if (strncmp(arg, "SIG", 3)==0)
+        arg+=3;
+    for (unsigned int i=0; i<sizeof(names)/sizeof(names[0]); i++)
+        if (strcmp(arg, names[i].name)==0)
+            return names[i].sig;
+    return -1;
+}
+/**
+ * Build the text shown for a job from its parsed stages, before make_argv() is applied
+ * @return string allocated in the command's arena
+ */
+char *command_text(struct command_t *command)
+{
+    size_t len=1;
+    for (struct command_t *c=command; c!=NULL; c=c->next) {
+        len+=strlen(c->name)+3;
+        for (int i=0; i<c->arg_count; i++)
+            len+=strlen(c->args[i])+1;
+        for (struct redirect_t *r=c->redirects; r!=NULL; r=r->next)
+            len+=(r->target ? strlen(r->target) : 0)+7;
+    }
+    char *text=arena_alloc(command->arena, len+2), *p=text;
+    for (struct command_t *c=command; c!=NULL; c=c->next) {
+        p+=sprintf(p, "%s%s", c==command ? "" : " | ", c->name);
+        for (int i=0; i<c->arg_count; i++)
+            p+=sprintf(p, " %s", c->args[i]);
+        for (struct redirect_t *r=c->redirects; r!=NULL; r=r->next) {
+            bool input=r->type==REDIRECT_IN || r->type==REDIRECT_STRING;
+            p+=sprintf(p, " ");
+            if (r->fd!=(input ? 0 : 1))
+                p+=sprintf(p, "%d", r->fd);
+            p+=sprintf(p, "%s%s", r->type==REDIRECT_DUP && r->fd==0 ? "<&" : redirect_ops[r->type],
+                       r->target ? r->target : "");
+        }
+    }
+    if (command->background)
+        strcpy(p, " &");
+    return text;
+}
+/**
+ * Close the descriptors open_redirects() opened, once the stage has them
+ */
+void close_redirects(struct fd_action *actions, int n)
+{
+    for (int i=0; i<n; i++)
+        if (actions[i].owned)
+            close(actions[i].source);
+}
+/**
+ * Turn the redirections of a stage into descriptor actions for launch(). Files
+ * and here-strings are opened here, in the parent, on descriptors above the ones
+ * redirections can name, so applying the actions in order never clobbers one.
+ * @param  command parsed stage
+ * @param  actions set to the actions, allocated in the command's arena
+ * @return         number of actions, -1 if a file could not be opened
+ */
+int open_redirects(struct command_t *command, struct fd_action **actions)
+{
+    int n=0, count=0;
+    for (struct redirect_t *r=command->redirects; r!=NULL; r=r->next)
+        n++;
+    *actions=arena_alloc(command->arena, sizeof(struct fd_action)*(n ? n : 1));
+    for (struct redirect_t *r=command->redirects; r!=NULL; r=r->next) {
+        struct fd_action *a=&(*actions)[count];
+        a->fd=r->fd;
+        a->owned=false;
+        if (r->target==NULL) {
+            fprintf(stderr, "-%s: syntax error: %s needs a target\n", sysname, redirect_ops[r->type]);
+            goto fail;
+        }
+        if (r->type==REDIRECT_DUP) {
+            if (strcmp(r->target, "-")==0)
+                a->source=-1;
+            else if (r->target[0]>='0' && r->target[0]<='9' && r->target[1]==0)
+                a->source=r->target[0]-'0';
+            else {
+                fprintf(stderr, "-%s: %s: bad file descriptor\n", sysname, r->target);
+                goto fail;
+            }
+            count++;
+            continue;
+        }
+
+        int fd;
+        if (r->type==REDIRECT_STRING) {  // the word and a newline in an anonymous file
+            fd=memfd_create("herestring", MFD_CLOEXEC);
+            size_t len=strlen(r->target);
+            if (fd!=-1 && (write(fd, r->target, len)!=(ssize_t)len || write(fd, "\n", 1)!=1
+                           || lseek(fd, 0, SEEK_SET)==-1)) {
+                close(fd);
+                fd=-1;
+            }
+        } else {
+            int flags=r->type==REDIRECT_IN ? O_RDONLY
+                      : r->type==REDIRECT_OUT ? O_WRONLY | O_CREAT | O_TRUNC
+                      : O_WRONLY | O_CREAT | O_APPEND;
+            fd=open(r->target, flags | O_CLOEXEC, 0666);
+        }
+        if (fd==-1) {
+            fprintf(stderr, "-%s: %s: %s\n", sysname, r->target, strerror(errno));
+            goto fail;
+        }
+        a->source=fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_FD_MIN);
+        close(fd);
+        if (a->source==-1) {
+            fprintf(stderr, "-%s: %s: %s\n", sysname, r->target, strerror(errno));
+            goto fail;
+        }
+        a->owned=true;
+        count++;
+    }
+    return count;
+fail:
+    close_redirects(*actions, count);
+    return -1;
+}
+/**
+ * Run a builtin that must stay in the shell, cd or exit, with its redirections
+ * applied to the shell's own descriptors. The ones they change are saved above
+ * REDIRECT_FD_MIN first and put back afterwards.
+ * @return the builtin's exit status, 1 if a redirection failed
+ */
+int redirect_builtin(const struct builtin_t *builtin, struct command_t *command)
+{
+    struct fd_action *actions;
+    int saved[REDIRECT_FD_MIN];  // copy of each descriptor, -1 if it was closed, -2 if untouched
+    int n=open_redirects(command, &actions), status=1;
+    if (n==-1)
+        return 1;
+    for (int i=0; i<REDIRECT_FD_MIN; i++)
+        saved[i]=-2;
+    fflush(stdout);
+    for (int i=0; i<n; i++) {
+        int fd=actions[i].fd;
+        if (saved[fd]!=-2)
+            continue;
+        saved[fd]=fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_FD_MIN);
+        if (saved[fd]==-1 && errno!=EBADF) {
+            fprintf(stderr, "-%s: %d: %s\n", sysname, fd, strerror(errno));
+            goto restore;
+        }
+    }
+    if (fd_actions_apply(actions, n)==0) {
+        status=builtin->handler(command);
+        fflush(stdout);
+    }
+restore:
+    for (int fd=0; fd<REDIRECT_FD_MIN; fd++)
+        if (saved[fd]==-1)
+            close(fd);
+        else if (saved[fd]>=0) {
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+        }
+    close_redirects(actions, n);
+    return status;
+}
+/*
+ * Background output capture: with bgcapture set, the stdout and stderr of every
+ * job started with & go to a pipe instead of the terminal. The shell drains the
+ * pipe without blocking into a ring of fixed size that keeps the newest output,
+ * from the prompt's epoll loop and while it waits for a foreground job, so a
+ * chatty job neither prints over the prompt nor stalls on a full terminal.
+ * joblog shows or follows what a job wrote, also after it finished.
+ */
+#define CAPTURE_KEEP 16     // captures of finished jobs kept for joblog
+#define CAPTURE_MAX (1ULL<<30)  // largest ring, each background job gets its own
+
+struct capture_t {
+    int id;             // job id, 0 until the job is in the table
+    char *cmdline;
+    int fd;             // read end of the job's output pipe, -1 after EOF
+    char *buf;
+    size_t cap;
+    uint64_t total;     // bytes received, the ring holds the last cap of them
+    bool done;          // the job left the table
+    struct capture_t *next;
+};
+struct capture_t *captures=NULL;    // newest first
+size_t capture_size=0;              // ring size for new background jobs, 0 to leave them on the terminal
+
+/**
+ * Set the ring size from $SHELLGIBI_BGCAPTURE
+ */
+void capture_init()
+{
+    const char *size=getenv("SHELLGIBI_BGCAPTURE");
+    if (size!=NULL && size[0]!=0 && capture_config(size)==-1)
+        fprintf(stderr, "-%s: SHELLGIBI_BGCAPTURE: %s: invalid size\n", sysname, size);
+}
+/**
+ * Change the ring size for jobs started from now on
+ * @param  size off, or a byte count with an optional K, M or G suffix, at most CAPTURE_MAX
+ * @return      0 on success, -1 for an invalid size
+ */
+int capture_config(const char *size)
+{
+    unsigned long long value=0;
+    if (strcmp(size, "off")!=0 && (parse_size(size, &value)==-1 || value>CAPTURE_MAX))
+        return -1;
+    capture_size=value;
+    return 0;
+}
+/**
+ * Start capturing the output of a background job
+ * @param  cmdline [description]
+ * @param  out     set to the write end of the pipe, for the stages
+ * @return         the capture, or NULL with errno set if the ring or the pipe could not be created
+ */
+struct capture_t *capture_new(const char *cmdline, int *out)
+{
+    int fds[2];
+    struct capture_t *c=calloc(1, sizeof(struct capture_t));
+    if (c==NULL)
+        return NULL;
+    c->cmdline=strdup(cmdline);
+    c->cap=capture_size;
+    c->buf=malloc(c->cap);  // large rings are mmap()ed, pages are only touched as output arrives
+    if (c->cmdline==NULL || c->buf==NULL || pipe2(fds, O_CLOEXEC)==-1) {
+        int err=errno;
+        free(c->cmdline);
+        free(c->buf);
+        free(c);
+        errno=err;
+        return NULL;
     }
-    if (strcmp(command->name, "myfg")==0) {  // puts a paused process at the foreground in running state
-
-        char cmd[100];
-
-        strcpy(cmd, "kill -CONT ");
-        strcat(cmd, command->args[0]);
-        system(cmd);
-
-        return SUCCESS;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    c->fd=fds[0];
+    c->next=captures;
+    captures=c;
+    if (events_fd!=-1) {
+        struct epoll_event ev={.events=EPOLLIN, .data.fd=c->fd};
+        epoll_ctl(events_fd, EPOLL_CTL_ADD, c->fd, &ev);
     }
-
-    if (strcmp(command->name, "alarm")==0) {  // sets an alarm at the specified time playing the specified .wav file
-        char cmd[100];
-        char min[2],hr[2];
-        if (command->args[0][1]=='.') {
-            hr[0]=command->args[0][0];
-            min[0]=command->args[0][2];
-            min[1]=command->args[0][3];
+    *out=fds[1];
+    return c;
+}
+void capture_free(struct capture_t *c)
+{
+    if (c->fd!=-1)
+        close(c->fd);
+    free(c->cmdline);
+    free(c->buf);
+    free(c);
+}
+/**
+ * Move what is in the pipe into the ring, at most one ring's worth per call
+ */
+void capture_read(struct capture_t *c)
+{
+    size_t budget=c->cap;
+    while (c->fd!=-1 && budget>0) {
+        size_t pos=c->total%c->cap, room=c->cap-pos;
+        ssize_t n=read(c->fd, c->buf+pos, room<budget ? room : budget);
+        if (n==-1 && errno==EINTR)
+            continue;
+        if (n==-1 && errno==EAGAIN)
+            return;
+        if (n<=0) {  // every writer is gone, close() also takes the fd out of the epoll set
+            close(c->fd);
+            c->fd=-1;
+            return;
         }
-        else {
-            hr[0]=command->args[0][0];
-            hr[1]=command->args[0][1];
-            min[0]=command->args[0][3];
-            min[1]=command->args[0][4];
-        }
-
-        char curdir[FILENAME_MAX];
-        getcwd( curdir, FILENAME_MAX );
-
-        strcpy(cmd,"echo \"");
-        strcat(cmd,min);
-        strcat(cmd," ");
-        strcat(cmd,hr);
-        strcat(cmd," * * * aplay ");
-        strcat(cmd,curdir);
-        strcat(cmd,"/");
-        strcat(cmd,command->args[1]);
-        strcat(cmd,"\" > crontemp.txt");
-
-        system(cmd);
-        system("crontab -r");
-        system("crontab crontemp.txt");
-        system("rm crontemp.txt");
-
-        return SUCCESS;
+        c->total+=n;
+        budget-=n;
     }
-
-    if (strcmp(command->name, "history")==0) {   // custom command 1: shows commands in the history
-        int histsize;
-        if (histflag)
-            histsize = HISTORY_SIZE;
-        else histsize = curind;
-
-        for (int i = histsize - 1; i >= 0; i--) {
-            printf("%s\n", history[i]);
+}
+/**
+ * Drain the capture reading from fd, for the prompt's event loop
+ * @return 0 if fd belongs to a capture, -1 otherwise
+ */
+int capture_read_fd(int fd)
+{
+    for (struct capture_t *c=captures; c!=NULL; c=c->next)
+        if (c->fd==fd) {
+            capture_read(c);
+            return 0;
         }
-        return SUCCESS;
-    }
-    if (strcmp(command->name, "wait")==0) {    // custom command 2: waits for the specified time in seconds
-        if (command->args[0]==NULL) {
-            fprintf(stderr, "No parameters in wait \n");
-            exit(0);
+    return -1;
+}
+/**
+ * Wait for a signal like sigsuspend(), draining the captures and starting the
+ * alarms that go off meanwhile
+ * @param mask signal mask to wait with
+ */
+void capture_wait(const sigset_t *mask)
+{
+    struct pollfd fds[MAX_JOBS+CAPTURE_KEEP+1];
+    struct capture_t *owner[MAX_JOBS+CAPTURE_KEEP+1];
+    int n=0;
+    for (struct capture_t *c=captures; c!=NULL && n<MAX_JOBS+CAPTURE_KEEP; c=c->next)
+        if (c->fd!=-1) {
+            fds[n].fd=c->fd;
+            fds[n].events=POLLIN;
+            owner[n++]=c;
         }
-        int sec=atoi(command->args[0]);
-        sleep(sec);
-        printf("Waited for %d secs\n", sec);
-        return SUCCESS;
+    if (alarm_fd!=-1) {
+        fds[n].fd=alarm_fd;
+        fds[n].events=POLLIN;
+        owner[n++]=NULL;
     }
-
-    if (strcmp(command->name, "lshome")==0) {  // custom command 3: lists the home folder content
-        char cmd[100];
-        strcpy(cmd,"ls ");
-        strcat(cmd,getenv("HOME"));
-        system(cmd);
-        return SUCCESS;
+    if (n==0) {
+        sigsuspend(mask);
+        return;
     }
-
-    int outputfile;
-    pid_t pid=fork();
-
-
-    if (pid==0) // child
-    {
-
-        command->args = (char **) realloc(
-                command->args, sizeof(char *) * (command->arg_count += 2));
-
-        // shift everything forward by 1
-        for (int i = command->arg_count - 2; i > 0; --i)
-            command->args[i] = command->args[i - 1];
-
-        // set args[0] as a copy of name
-        command->args[0] = strdup(command->name);
-        // set args[arg_count-1] (last) to NULL
-        command->args[command->arg_count - 1] = NULL;
-
-        command->arg_count--;
-
-        if (command->auto_complete) {   // when Tab key pressed  autocomplete part is executed
-
-            char environment[1000];
-
-            int currentdir=0;
-            if (command->name[1] == '/' && command->name[0] == '.') {  // if current folder is specified it doesnt look at other paths
-
-                strcat(environment, "./");
-                currentdir=1;
-            }
-            else {
-                strcpy(environment, getenv("PATH"));  // gets all path definitions from the environment.
-
-            }
-                char name[100];
-                strcat(environment, ":");
-                strcpy(name,command->name);
-                name[strlen(name)-1]='*';
-                char *path;
-                path=strtok(environment, ":");
-
-                while (path != NULL) {   // for each folder in the path, it is searched
-                    size_t size = snprintf(NULL, 0, "%s/%s*", path, command->name);
-                    char *tmp = (char *)malloc(size + 1);
-                    if (tmp == NULL)
-                        exit(EXIT_FAILURE);
-
-                    strcpy(tmp, path);
-                    strcat(tmp, "/");
-                    strcat(tmp, name);
-
-                    if (currentdir==1)
-                        strcpy(tmp,name);
-                    char arg[100]="ls -1 ";
-                    strcat(arg,tmp);
-                    strcat(arg," >> y.txt 2> /dev/null");  // creates a folder named y.txt and y.txt contains all the appropriate commands
-                    system(arg);
-                    path = strtok(NULL, ":");
-
-                    free(tmp);
-                }
-                FILE *fptr;
-                char line[100000], tmpLine[100000];
-                int counter=0;
-
-                if ( (fptr = fopen ("y.txt", "r")) == NULL) {
-                    printf("Error! opening file");
-                    exit(1);
-                }
-
-
+    if (ppoll(fds, n, NULL, mask)<=0)
+        return;
+    for (int i=0; i<n; i++)
+        if (fds[i].revents && owner[i]==NULL)
+            alarm_run_due();
+        else if (fds[i].revents)
+            capture_read(owner[i]);
+}
+/**
+ * Keep the capture of a job that leaves the table, dropping the oldest finished ones
+ */
+void capture_finish(struct capture_t *capture)
+{
+    int kept=0;
+    capture->done=true;
+    for (struct capture_t **p=&captures; *p!=NULL;) {
+        struct capture_t *c=*p;
+        if (c->done && ++kept>CAPTURE_KEEP) {
+            *p=c->next;
+            capture_free(c);
+        } else
+            p=&c->next;
+    }
+}
+/**
+ * Write the captured output from byte offset from to the end
+ * @return offset of the end
+ */
+uint64_t capture_write(struct capture_t *c, uint64_t from)
+{
+    if (c->total>c->cap && from<c->total-c->cap) {
+        fprintf(stderr, "[%llu bytes dropped]\n", (unsigned long long)(c->total-c->cap-from));
+        from=c->total-c->cap;
+    }
+    while (from<c->total) {
+        size_t pos=from%c->cap, len=c->cap-pos;
+        if (len>c->total-from)
+            len=c->total-from;
+        fwrite(c->buf+pos, 1, len, stdout);
+        from+=len;
+    }
+    fflush(stdout);
+    return from;
+}
+/**
+ * List the captured jobs
+ */
+void capture_list()
+{
+    for (struct capture_t *c=captures; c!=NULL; c=c->next) {
+        capture_read(c);
+        printf("[%d]  %-8s %8llu bytes  %s\n", c->id, c->done ? "Done" : "Running",
+               (unsigned long long)c->total, c->cmdline);
+    }
+}
+/**
+ * Print the captured output of a job
+ * @param  spec   job id, with or without %
+ * @param  follow keep printing what the job writes until it closes its output or ^C
+ * @return        0 on success, 1 if the job has no capture
+ */
+int capture_show(const char *spec, bool follow)
+{
+    int id=atoi(spec[0]=='%' ? spec+1 : spec);
+    struct capture_t *c=captures;
+    while (c!=NULL && c->id!=id)  // newest first: ids are reused
+        c=c->next;
+    if (c==NULL)
+        return 1;
+    capture_read(c);
+    uint64_t printed=capture_write(c, 0);
+    while (follow && c->fd!=-1) {
+        struct pollfd pfd={c->fd, POLLIN, 0};
+        if (poll(&pfd, 1, -1)==-1) {  // interrupted by ^C
             printf("\n");
-                while(fscanf(fptr, "%s[^\n]", line) != EOF) {    // read each line of the temporary y.txt file
-                    printf("%s\n", line);
-                    counter++;
-                }
-                printf("\n");
-                fclose(fptr);
-                system("rm y.txt  2> /dev/null");    // remove y.txt
-
-                if(counter==1){    // if there is only one item in the list it is being executed
-                    strcpy(tmpLine,line);
-                    size_t size = snprintf(NULL, 0, "%s*", line);
-                    char *token=(char *)malloc(size + 1);
-                    char *prvtoken=(char *)malloc(size + 1);;
-                    token=strtok(tmpLine, "/");
-
-                    while (token != NULL) {
-                        prvtoken=token;
-                        token = strtok(NULL, "/");
-                    }
-
-                    strcat(prvtoken,"?");
-                    strcpy(command->args[0],line);
-
-                    if (strcmp(prvtoken,command->name))
-                        execv(line, command->args);
-                    else {
-                        system("ls");  // if the command is fully typed, current folder is listed
-                    }
-                }
-
-
+            break;
         }
+        capture_read(c);
+        printed=capture_write(c, printed);
+    }
+    return 0;
+}
+/**
+ * Run a ( list ) in the forked child of a pipeline stage. The subshell has no
+ * job control and none of the parent's jobs.
+ * @return exit status of the list
+ */
+int subshell_run(struct node_t *list)
+{
+    interactive=0;
+    captures=NULL;  // the shell drains them, not its copies
+    memset(jobs, 0, sizeof(jobs));
+    job_current=0;
+    jobs_init();  // SIGCHLD was reset to its default for the stage
+    execute_node(list);
+    return last_status;
+}
+/**
+ * Runs every stage of a pipeline concurrently: all pipes are created up front,
+ * every stage is forked into one process group and the whole group is reaped
+ * with waitpid(). Nothing waits for a stage before starting the next one, so
+ * stages stream into each other and `yes | head` terminates. A single command
+ * is a pipeline with one stage.
+ * @param  command first stage of the pipeline
+ * @return         pipefail status: the status of the rightmost failing stage, 0 if all succeeded
+ */
+int runPipe (struct command_t *command)
+{
+    int nstages=0;
+    for (struct command_t *c=command; c!=NULL; c=c->next)
+        nstages++;
 
-        // I/O Redirection
-        if(command->redirects[1]!=NULL){  // output redirection with '>'
-            outputfile = open(command->args[command->arg_count-1],  O_WRONLY | O_CREAT | O_TRUNC ,S_IRUSR | S_IWUSR | S_IRGRP);
-            dup2(outputfile,1);
-            close(outputfile);
-            command->args[command->arg_count-1]=NULL;
-
-
-        }else if(command->redirects[2]!=NULL){ // output redirection with '>>'
-            outputfile = open(command->args[command->arg_count-1], O_WRONLY | O_CREAT | O_APPEND,S_IRUSR | S_IWUSR | S_IRGRP);
-            dup2(outputfile,1);
-            close(outputfile);
-            command->args[command->arg_count-1]=NULL;
-        }else if(command->redirects[0]!= NULL){ // input redirection with '<'
-            FILE *fptr;
-
-            char input[100]={"input"};
-
-            fptr = fopen (command->args[1], "r");
+    int (*pipes)[2]=arena_alloc(command->arena, sizeof(int[2])*nstages);
+    pid_t *pids=arena_alloc(command->arena, sizeof(pid_t)*nstages);
+    int *failed=arena_alloc(command->arena, sizeof(int)*nstages);  // exit code of a stage that never started, 0 otherwise
+    struct job_timing *timing=arena_alloc(command->arena, sizeof(struct job_timing)*nstages);
+    pid_t pgid=0;
+    char *cmdline=command_text(command);
+    sigset_t old;
+    struct capture_t *capture=NULL;
+    int capture_out=-1;  // stdout of the last stage and stderr of all, -1 for the terminal
+    fflush(stdout);  // builtin output must come before what the children write
 
-            fgets(input,100,fptr);
-            input[strlen(input)-1]='\0';
+    for (int i=0; i<nstages-1; i++) {
+        if (pipe2(pipes[i], O_CLOEXEC)==-1) {  // close-on-exec: stages only keep what they dup2()
+            fprintf(stderr, "-%s: pipe: %s\n", sysname, strerror(errno));
+            for (int j=0; j<i; j++) {
+                close(pipes[j][0]);
+                close(pipes[j][1]);
+            }
+            return 1;
+        }
+    }
+    if (command->background && interactive && capture_size>0) {
+        capture=capture_new(cmdline, &capture_out);
+        if (capture==NULL)  // the job still runs, on the terminal
+            fprintf(stderr, "-%s: bgcapture: %s, not capturing this job\n", sysname, strerror(errno));
+    }
 
-            char *const *inputfile= (char *const *) input;
-            execv(command->name, inputfile);
+    block_sigchld(&old);  // children must not be reaped before they are in the job table
+    int started=0;
+    struct command_t *c=command;
+    for (int i=0; i<nstages; i++, c=c->next) {
+        pids[i]=0;
+        failed[i]=0;
+        memset(&timing[i], 0, sizeof(timing[i]));
+        struct function_t *function=function_find(c->name);
+        const struct builtin_t *builtin=function ? NULL : find_builtin(c->name);
+        struct launch_t l;
+        l.path=builtin || function || c->subshell ? NULL : findPath(c->name);  // cache hit, execute_command() already resolved every stage
+        l.rctl=c->rctl;
+        l.pgid=interactive ? pgid : -1;  // the first stage leads the group, scripts need no job control
+        l.fds[0]=i>0 ? pipes[i-1][0] : -1;
+        l.fds[1]=i<nstages-1 ? pipes[i][1] : capture_out;
+        l.fds[2]=capture_out;
+        l.nactions=open_redirects(c, &l.actions);
+        if (l.nactions==-1) {
+            failed[i]=1;
+            continue;
+        }
 
-        } else if(command->next != NULL) {  // pipe redirection
-            runPipe(command,STDIN_FILENO);  // all pipe related actions
-            return SUCCESS;
+        if (l.path!=NULL) {
+            make_argv(c);
+            l.argv=c->args;
         }
 
-        /// TODO: do your own exec with path resolving using execv()
-        if (command->name[0] == '/' || command->name[0] == '.') {
-            execv(command->name, command->args);
+        pid_t pid;
+        char **saved=c->env_count>0 ? env_apply(c->arena, c->env_names, c->env_values, c->env_count) : NULL;
+        timing[i].spawn=wall_us();
+        if (l.path==NULL) {
+            fflush(stdout);
+            pid=fork();
+            if (pid==0) {  // builtin, function or subshell stage: run it in the child, no exec needed
+                zygote_detach();
+                if (interactive)
+                    setpgid(0, pgid);
+                sigset_t mask;
+                for (int j=0; job_signals[j]; j++)
+                    signal(job_signals[j], SIG_DFL);
+                sigemptyset(&mask);  // not old: alarms start jobs while the prompt blocks its signals
+                sigprocmask(SIG_SETMASK, &mask, NULL);
+                if (launch_apply_fds(&l)==-1)
+                    _exit(1);
+                if (l.rctl!=NULL && rctl_apply(l.rctl, c->name)==-1)
+                    _exit(126);
+                for (int j=0; j<nstages-1; j++) {  // close-on-exec does not help without an exec
+                    close(pipes[j][0]);
+                    close(pipes[j][1]);
+                }
+                int code;
+                if (function!=NULL) {
+                    function_call(function, c, true);
+                    code=last_status;
+                } else
+                    code=c->subshell ? subshell_run(c->subshell) : builtin->handler(c);
+                fflush(stdout);
+                _exit(code);
+            }
+            if (pid>0 && interactive)
+                setpgid(pid, pgid ? pgid : pid);
+        } else
+            pid=launch(&l);
+        if (saved!=NULL) {  // the child has its copy of the environment, the other stages must not
+            int err=errno;
+            env_restore(c->env_names, saved, c->env_count);
+            errno=err;
         }
+        close_redirects(l.actions, l.nactions);
+        if (pid==-1) {
+            fprintf(stderr, "-%s: %s: %s\n", sysname, c->name, strerror(errno));
+            failed[i]=errno==ENOENT ? 127 : 126;
+            continue;
+        }
+        if (pgid==0)
+            pgid=pid;
+        timing[i].exec=wall_us();
+        pids[i]=pid;
+        started++;
+    }
 
-        else {
+    for (int j=0; j<nstages-1; j++) {  // the parent holds no pipe ends, so EOF reaches every reader
+        close(pipes[j][0]);
+        close(pipes[j][1]);
+    }
+    if (capture_out!=-1)
+        close(capture_out);
 
-            const char *path2;
-            path2=findPath(command->name);  // find the path from the name of the command
-            execv(path2, command->args);  // using the path of the command, execute the command
+    int result=0;
+    for (int i=0; i<nstages; i++)  // pipefail over the stages that never started, for when no job is made
+        if (failed[i]!=0)
+            result=failed[i];
+    if (started>0) {
+        struct job_t *job=job_add(pgid, pids, nstages, cmdline, command->background);
+        if (job!=NULL) {  // SIGCHLD is still blocked, nothing has been reaped yet
+            memcpy(job->timing, timing, sizeof(struct job_timing)*nstages);
+            for (int i=0; i<nstages; i++)
+                if (pids[i]==0) {  // a failed stage keeps its slot, so job_status() sees it in order
+                    job->states[i]=JOB_DONE;
+                    job->status[i]=W_EXITCODE(failed[i], 0);
+                }
         }
+        if (job==NULL) {
+            fprintf(stderr, "-%s: too many jobs\n", sysname);
+            for (int i=0; i<nstages; i++)
+                if (pids[i]>0)
+                    kill(pids[i], SIGKILL);
+            if (capture!=NULL)
+                capture_finish(capture);
+        } else if (command->background) {
+            job_current=job->id;
+            job->capture=capture;
+            if (capture!=NULL)
+                capture->id=job->id;
+            if (interactive)
+                printf("[%d] %d\n", job->id, pgid);
+        } else {
+            result=job_wait_fg(job);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return result;
+}
 
-        exit(0);
-
+/*
+ * Instrumentation: the time prefix reports what a command line cost, and trace
+ * mode appends one JSON line per process (and per builtin run in the shell) to a
+ * file, with spawn, exec and reap timestamps and the usage returned by wait4().
+ * Turn tracing on with SHELLGIBI_TRACE=file or the trace builtin.
+ */
+int trace_fd=-1;
 
+void trace_init()
+{
+    const char *file=getenv("SHELLGIBI_TRACE");
+    if (file!=NULL && file[0]!=0 && trace_open(file)==-1)
+        fprintf(stderr, "-%s: %s: %s\n", sysname, file, strerror(errno));
+}
+/**
+ * Start tracing to a file, or stop with NULL
+ * @return 0 on success, -1 with errno set otherwise
+ */
+int trace_open(const char *file)
+{
+    int fd=-1;
+    if (file!=NULL) {
+        fd=open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd==-1)
+            return -1;
     }
-    else
-    {
-        if (!command->background)
-            wait(0); // wait for child process to finish
-        return SUCCESS;
+    if (trace_fd!=-1)
+        close(trace_fd);
+    trace_fd=fd;
+    return 0;
+}
+/**
+ * Copy a string into a JSON string literal, without the quotes
+ */
+void json_escape(char *out, int size, const char *s)
+{
+    int n=0;
+    for (; *s && n<size-7; s++) {
+        unsigned char c=*s;
+        if (c=='"' || c=='\\')
+            n+=sprintf(out+n, "\\%c", c);
+        else if (c<0x20)
+            n+=sprintf(out+n, "\\u%04x", c);
+        else
+            out[n++]=c;
     }
-
-
-
+    out[n]=0;
 }
-
-const char* findPath(char *cmd) {    // this method finds the path of any command using its name
-
-    FILE *fptr;
-    char *path=malloc(100);
-    char arg[100]="which ";
-    strcat(arg,cmd);
-    strcat(arg," > x.txt");  // the method creates a file called x.txt using output redirection.
-                                // The file contains the path of the command
-    system(arg);
-
-    fptr = fopen ("x.txt", "r");   // read the path from x.txt
-    fgets(path,100,fptr);
-    path[strlen(path)-1]='\0';
-    system("rm x.txt");  // remove x.txt
-    return path;
+double timeval_us(const struct timeval *tv)
+{
+    return tv->tv_sec*1e6+tv->tv_usec;
 }
+void trace_job(struct job_t *job)
+{
+    char cmd[1024];
+    json_escape(cmd, sizeof(cmd), job->cmdline);
+    for (int p=0; p<job->nprocs; p++) {
+        struct job_timing *t=&job->timing[p];
+        struct rusage *u=&job->usage[p];
+        dprintf(trace_fd, "{\"job\":%d,\"stage\":%d,\"pid\":%d,\"cmd\":\"%s\",\"spawn\":%.0f,\"exec\":%.0f,\"reap\":%.0f,"
+                "\"status\":%d,\"utime_us\":%.0f,\"stime_us\":%.0f,\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld}\n",
+                job->id, p, job->pids[p], cmd, t->spawn, t->exec, t->reap, status_code(job->status[p]),
+                timeval_us(&u->ru_utime), timeval_us(&u->ru_stime), u->ru_maxrss, u->ru_nvcsw, u->ru_nivcsw);
+    }
+}
+void trace_builtin(const char *name, double start, double end, int status)
+{
+    char cmd[256];
+    json_escape(cmd, sizeof(cmd), name);
+    dprintf(trace_fd, "{\"builtin\":\"%s\",\"start\":%.0f,\"end\":%.0f,\"status\":%d}\n", cmd, start, end, status);
+}
+void print_duration(const char *label, double us)
+{
+    long ms=us/1000;
+    fprintf(stderr, "%s\t%ldm%ld.%03lds\n", label, ms/60000, ms/1000%60, ms%1000);
+}
+/**
+ * time: run a pipeline and report wall, user and sys time,
+ * the largest resident set and the context switches of its processes. Builtins
+ * that run in the shell are charged with the shell's own usage.
+ * @return what execute_command() returned for the timed command
+ */
+int time_command(struct command_t *command)
+{
+    struct timespec start;
+    struct rusage before, after, total;
+    int code=SUCCESS;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    getrusage(RUSAGE_SELF, &before);
+    memset(&last_usage, 0, sizeof(last_usage));
+    command->timed=false;
+    code=execute_command(command);
+    double real=elapsed_us(&start);
+    getrusage(RUSAGE_SELF, &after);
 
+    total=last_usage;
+    timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+    timeradd(&total.ru_utime, &after.ru_utime, &total.ru_utime);
+    timeradd(&total.ru_stime, &after.ru_stime, &total.ru_stime);
+    total.ru_nvcsw+=after.ru_nvcsw-before.ru_nvcsw;
+    total.ru_nivcsw+=after.ru_nivcsw-before.ru_nivcsw;
+    if (total.ru_maxrss==0)  // nothing was forked, the shell itself did the work
+        total.ru_maxrss=after.ru_maxrss;
 
+    fprintf(stderr, "\n");
+    print_duration("real", real);
+    print_duration("user", timeval_us(&total.ru_utime));
+    print_duration("sys", timeval_us(&total.ru_stime));
+    fprintf(stderr, "maxrss\t%ld KiB\n", total.ru_maxrss);
+    fprintf(stderr, "ctxsw\t%ld voluntary, %ld involuntary\n", total.ru_nvcsw, total.ru_nivcsw);
+    return code;
+}
 
-void runPipe (struct command_t *command, int fdtmp) {   // this recursive method performs all required activities for pipe
-
-    if (command->next==NULL) {  // if the last command is reached at command->next
-        const char *path=findPath(command->name);
-        dup2(fdtmp, 0);       // already opened file descriptor is being used as input.
-        if (command->arg_count>0) {
-            if (strcmp(command->name,command->args[0])!=0) {
-                command->args = (char **) realloc(
-                        command->args, sizeof(char *) * (command->arg_count += 1));
-
-                for (int i = command->arg_count - 1; i > 0; --i)
-                    command->args[i] = command->args[i - 1];
+/*
+ * parallel: runs a command once per item with at most N copies at a time. It is
+ * a forked builtin stage, so the commands it starts through launch() stay in the
+ * job's process group and it reaps them itself: a pidfd per child wakes its poll()
+ * loop, which also collects their output when -g or -k asks for it.
+ */
+struct par_job {
+    long seq;           // position of the item, from 1
+    char *cmdline;
+    pid_t pid;          // 0 once reaped
+    int pidfd;
+    int out;            // read end of the output pipe, -1 when not buffering or at EOF
+    char *buf;
+    size_t len, cap;
+    int status;
+    double start, end;  // microseconds since the epoch
+};
+struct par_state {
+    int jobs;           // -j
+    bool keep_order;    // -k
+    bool group;         // -g, implied by -k
+    bool verbose;       // -v
+    char **tmpl;        // command with {} where the item goes
+    int ntmpl;
+    char **items;       // after :::, NULL to read lines from stdin
+    int nitems, next_item;
+    struct par_job **done;  // finished jobs waiting for their turn with -k
+    long ndone, next_print;
+    long started, failed;
+};
 
-                command->args[0] = strdup(command->name);
-            }
+/**
+ * Get the next item from the ::: list or from stdin
+ * @return malloc'ed item, NULL when there are no more
+ */
+char *par_next_item(struct par_state *st)
+{
+    if (st->items!=NULL)
+        return st->next_item<st->nitems ? strdup(st->items[st->next_item++]) : NULL;
+    char *line=NULL;
+    size_t cap=0;
+    ssize_t n=getline(&line, &cap, stdin);
+    if (n<=0) {
+        free(line);
+        return NULL;
+    }
+    if (line[n-1]=='\n')
+        line[n-1]=0;
+    return line;
+}
+/**
+ * Replace every {} in a template word with the item
+ * @return malloc'ed word
+ */
+char *par_subst(const char *word, const char *item)
+{
+    size_t len=strlen(word)+1, ilen=strlen(item);
+    for (const char *p=word; (p=strstr(p, "{}"))!=NULL; p+=2)
+        len+=ilen;
+    char *out=malloc(len), *o=out;
+    for (const char *p=word, *q; ; p=q+2) {
+        q=strstr(p, "{}");
+        if (q==NULL) {
+            strcpy(o, p);
+            break;
         }
-        execv(path, command->args);
+        memcpy(o, p, q-p);
+        o+=q-p;
+        memcpy(o, item, ilen);
+        o+=ilen;
+    }
+    return out;
+}
+void par_write(int fd, const char *buf, size_t len)
+{
+    while (len>0) {
+        ssize_t n=write(fd, buf, len);
+        if (n<0 && errno==EINTR)
+            continue;
+        if (n<=0)
+            return;
+        buf+=n;
+        len-=n;
+    }
+}
+void par_free(struct par_job *job)
+{
+    free(job->cmdline);
+    free(job->buf);
+    free(job);
+}
+/**
+ * A job has exited and its output is complete: report it and write its output
+ */
+void par_finish(struct par_state *st, struct par_job *job)
+{
+    int code=status_code(job->status);
+    if (code!=0)
+        st->failed++;
+    if (st->verbose || code!=0)
+        fprintf(stderr, "parallel: %ld\t%d\t%.3fs\t%s\n", job->seq, code,
+                (job->end-job->start)/1e6, job->cmdline);
+    if (!st->keep_order) {
+        par_write(STDOUT_FILENO, job->buf, job->len);
+        par_free(job);
         return;
     }
-
-    int fdpipe[2];
-
-    if(pipe(fdpipe) == -1) {
-        fprintf(stderr, "pipe error\n");
-        exit(1);
+    if (job->seq>=st->ndone) {
+        long n=st->ndone ? st->ndone : 64;
+        while (n<=job->seq)
+            n*=2;
+        st->done=realloc(st->done, sizeof(struct par_job *)*n);
+        memset(st->done+st->ndone, 0, sizeof(struct par_job *)*(n-st->ndone));
+        st->ndone=n;
+    }
+    st->done[job->seq]=job;
+    while (st->next_print<st->ndone && st->done[st->next_print]!=NULL) {
+        struct par_job *next=st->done[st->next_print];
+        par_write(STDOUT_FILENO, next->buf, next->len);
+        st->done[st->next_print++]=NULL;
+        par_free(next);
+    }
+}
+/**
+ * Start the command for one item
+ * @return the running job, NULL if it could not be started (it is reported as failed)
+ */
+struct par_job *par_start(struct par_state *st, const char *item, int devnull)
+{
+    char **argv=calloc(st->ntmpl+2, sizeof(char *));
+    bool placed=false;
+    size_t len=1;
+    for (int i=0; i<st->ntmpl; i++) {
+        placed|=strstr(st->tmpl[i], "{}")!=NULL;
+        argv[i]=par_subst(st->tmpl[i], item);
     }
+    int argc=st->ntmpl;
+    if (!placed)  // no {}: the item is the last argument
+        argv[argc++]=strdup(item);
+    for (int i=0; i<argc; i++)
+        len+=strlen(argv[i])+1;
+
+    struct par_job *job=calloc(1, sizeof(struct par_job));
+    job->seq=++st->started;
+    job->cmdline=malloc(len);
+    job->cmdline[0]=0;
+    for (int i=0; i<argc; i++)
+        strcat(strcat(job->cmdline, i ? " " : ""), argv[i]);
+    job->pidfd=-1;
+    job->out=-1;
+    job->start=wall_us();
 
-    struct command_t *cmdtmp;
-    cmdtmp = command->next;
+    struct launch_t l;
+    int pipefd[2]={-1, -1};
+    l.path=findPath(argv[0]);
+    l.argv=argv;
+    l.rctl=NULL;
+    l.pgid=-1;  // stay in the group of the parallel stage itself
+    l.fds[0]=devnull;
+    l.fds[1]=-1;
+    l.fds[2]=-1;
+    l.actions=NULL;
+    l.nactions=0;
+    if (st->group && pipe2(pipefd, O_CLOEXEC)==0)
+        l.fds[1]=pipefd[1];
+    if (l.path==NULL) {
+        fprintf(stderr, "-%s: %s: command not found\n", sysname, argv[0]);
+        job->pid=-1;
+    } else if ((job->pid=launch(&l))==-1)
+        fprintf(stderr, "-%s: %s: %s\n", sysname, argv[0], strerror(errno));
+    if (pipefd[1]!=-1)
+        close(pipefd[1]);
+    for (int i=0; i<argc; i++)
+        free(argv[i]);
+    free(argv);
 
-    const char *path1=findPath(command->name);
-    const char *path2=findPath(cmdtmp->name);
+    if (job->pid==-1) {
+        if (pipefd[0]!=-1)
+            close(pipefd[0]);
+        job->status=W_EXITCODE(127, 0);
+        job->end=wall_us();
+        par_finish(st, job);
+        return NULL;
+    }
+    job->out=pipefd[0];
+    job->pidfd=syscall(SYS_pidfd_open, job->pid, 0);
+    return job;
+}
+/**
+ * parallel [-j N] [-k] [-g] [-v] command [args with {}] [::: items...]
+ * @return number of failed jobs, 101 for more than 100, 255 for a usage error
+ */
+int parallel_run(struct command_t *command)
+{
+    struct par_state st;
+    memset(&st, 0, sizeof(st));
+    st.jobs=sysconf(_SC_NPROCESSORS_ONLN);
+    st.next_print=1;
 
+    int i;
+    for (i=0; i<command->arg_count && command->args[i][0]=='-'; i++) {
+        char *opt=command->args[i];
+        if (strncmp(opt, "-j", 2)==0) {
+            const char *n=opt[2] ? opt+2 : i+1<command->arg_count ? command->args[++i] : "";
+            st.jobs=atoi(n);
+            if (st.jobs<=0)
+                st.jobs=strcmp(n, "0")==0 ? 1024 : -1;  // -j0: as many as possible
+        } else if (strcmp(opt, "-k")==0)
+            st.keep_order=st.group=true;
+        else if (strcmp(opt, "-g")==0)
+            st.group=true;
+        else if (strcmp(opt, "-v")==0)
+            st.verbose=true;
+        else
+            break;
+    }
+    st.tmpl=command->args+i;
+    for (; i<command->arg_count && strcmp(command->args[i], ":::")!=0; i++)
+        st.ntmpl++;
+    if (i<command->arg_count) {
+        st.items=command->args+i+1;
+        st.nitems=command->arg_count-i-1;
+    }
+    if (st.ntmpl==0 || st.jobs<=0) {
+        fprintf(stderr, "usage: parallel [-j N] [-k] [-g] [-v] command [args with {}] [::: items...]\n");
+        return 255;
+    }
 
-    if(fork() == 0)    // the first command is executed
-    {
-        dup2(fdtmp,0);
-        dup2(fdpipe[1], 1);
-        close(fdpipe[0]);
-        if (command->arg_count>0) {
-            if (strcmp(command->name,command->args[0])!=0) {
-                command->args = (char **) realloc(
-                        command->args, sizeof(char *) * (command->arg_count += 1));
+    // commands must not eat the items when they come from stdin
+    int devnull=st.items==NULL ? open("/dev/null", O_RDONLY | O_CLOEXEC) : -1;
+    struct par_job **running=calloc(st.jobs, sizeof(struct par_job *));
+    struct pollfd *fds=calloc(st.jobs*2, sizeof(struct pollfd));
+    int nrunning=0;
+    bool more=true;
+    double start=wall_us();
+    while (1) {
+        while (more && nrunning<st.jobs) {
+            char *item=par_next_item(&st);
+            if (item==NULL) {
+                more=false;
+                break;
+            }
+            struct par_job *job=par_start(&st, item, devnull);
+            free(item);
+            if (job!=NULL)
+                running[nrunning++]=job;
+        }
+        if (nrunning==0)
+            break;
 
-                for (int i = command->arg_count - 1; i > 0; --i)
-                    command->args[i] = command->args[i - 1];
+        int n=0, timeout=-1;
+        for (int j=0; j<nrunning; j++) {
+            if (running[j]->pid!=0 && running[j]->pidfd!=-1)
+                fds[n++]=(struct pollfd){running[j]->pidfd, POLLIN, 0};
+            else if (running[j]->pid!=0)
+                timeout=10;  // no pidfd on this kernel: look for exits now and then
+            if (running[j]->out!=-1)
+                fds[n++]=(struct pollfd){running[j]->out, POLLIN, 0};
+        }
+        if (poll(fds, n, timeout)==-1 && errno!=EINTR)
+            break;
 
-                command->args[0] = strdup(command->name);
+        for (int j=0; j<nrunning; j++) {
+            struct par_job *job=running[j];
+            if (job->out==-1)
+                continue;
+            for (int k=0; k<n; k++) {
+                if (fds[k].fd!=job->out || !(fds[k].revents & (POLLIN | POLLHUP)))
+                    continue;
+                if (job->cap-job->len<65536) {
+                    job->cap=job->cap ? job->cap*2 : 65536;
+                    job->buf=realloc(job->buf, job->cap);
+                }
+                ssize_t r=read(job->out, job->buf+job->len, job->cap-job->len);
+                if (r>0)
+                    job->len+=r;
+                else if (r==0 || errno!=EINTR) {
+                    close(job->out);
+                    job->out=-1;
+                }
             }
         }
-        execv(path1, command->args);
+        pid_t pid;
+        int status;
+        while ((pid=waitpid(-1, &status, WNOHANG))>0)
+            for (int j=0; j<nrunning; j++)
+                if (running[j]->pid==pid) {
+                    running[j]->pid=0;
+                    running[j]->status=status;
+                    running[j]->end=wall_us();
+                    if (running[j]->pidfd!=-1)
+                        close(running[j]->pidfd);
+                }
+        for (int j=0; j<nrunning; j++)
+            if (running[j]->pid==0 && running[j]->out==-1) {
+                par_finish(&st, running[j]);
+                running[j--]=running[--nrunning];
+            }
+    }
+    fflush(stdout);
+    fprintf(stderr, "parallel: %ld jobs, %ld failed, -j %d, makespan %.3fs\n",
+            st.started, st.failed, st.jobs, (wall_us()-start)/1e6);
+    if (devnull!=-1)
+        close(devnull);
+    free(running);
+    free(fds);
+    free(st.done);
+    return st.failed>100 ? 101 : st.failed;
+}
+
+/*
+ * Alarm scheduler: pending alarms live in a min-heap ordered by their wall-clock
+ * deadline, and a single timerfd is armed for the earliest one. prompt() polls the
+ * timerfd next to the terminal and capture_wait() polls it while a foreground job
+ * runs, so alarms go off on time and the scheduled command is started as a
+ * background job. The command is kept as the expanded words it was given, not as
+ * text, so nothing in them is parsed or expanded a second time. Nothing is
+ * written to disk and the user's crontab is left alone.
+ */
+struct alarm_t {
+    int id;
+    time_t deadline;
+    char *cmdline;              // shown by alarm -l and when it goes off
+    struct arena_t arena;       // holds the command and cmdline
+    struct command_t *command;
+};
+struct alarm_t **alarm_heap=NULL;
+int alarm_count=0, alarm_cap=0;
+int alarm_next_id=1;
+int alarm_fd=-1;    // timerfd armed for alarm_heap[0]
+
+void alarm_swap(int i, int j)
+{
+    struct alarm_t *tmp=alarm_heap[i];
+    alarm_heap[i]=alarm_heap[j];
+    alarm_heap[j]=tmp;
+}
+void alarm_sift_up(int i)
+{
+    while (i>0 && alarm_heap[(i-1)/2]->deadline>alarm_heap[i]->deadline) {
+        alarm_swap(i, (i-1)/2);
+        i=(i-1)/2;
+    }
+}
+void alarm_sift_down(int i)
+{
+    while (1) {
+        int smallest=i, l=2*i+1, r=2*i+2;
+        if (l<alarm_count && alarm_heap[l]->deadline<alarm_heap[smallest]->deadline)
+            smallest=l;
+        if (r<alarm_count && alarm_heap[r]->deadline<alarm_heap[smallest]->deadline)
+            smallest=r;
+        if (smallest==i)
+            return;
+        alarm_swap(i, smallest);
+        i=smallest;
+    }
+}
+/**
+ * Remove the alarm at heap position i and return it
+ */
+struct alarm_t *alarm_remove(int i)
+{
+    struct alarm_t *a=alarm_heap[i];
+    alarm_heap[i]=alarm_heap[--alarm_count];
+    if (i<alarm_count) {
+        alarm_sift_down(i);
+        alarm_sift_up(i);
+    }
+    return a;
+}
+/**
+ * Arm the timerfd for the earliest alarm, or disarm it when there is none
+ */
+void alarm_rearm()
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (alarm_fd==-1) {
+        alarm_fd=timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (alarm_fd==-1)
+            return;
+    }
+    if (alarm_count>0)
+        its.it_value.tv_sec=alarm_heap[0]->deadline;
+    timerfd_settime(alarm_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+void alarm_free(struct alarm_t *a)
+{
+    arena_free(&a->arena);
+    free(a);
+}
+/**
+ * Schedule a command
+ * @param  argv the command and its arguments, already expanded
+ * @return      id of the new alarm
+ */
+int alarm_add(time_t deadline, char **argv, int argc)
+{
+    if (alarm_count==alarm_cap) {
+        alarm_cap=alarm_cap ? alarm_cap*2 : 8;
+        alarm_heap=realloc(alarm_heap, sizeof(struct alarm_t *)*alarm_cap);
+    }
+    struct alarm_t *a=calloc(1, sizeof(struct alarm_t));
+    a->id=alarm_next_id++;
+    a->deadline=deadline;
+    struct command_t *c=command_new(&a->arena);
+    size_t len=1;
+    c->name=arena_strdup(&a->arena, argv[0]);
+    c->args=arena_alloc(&a->arena, sizeof(char *)*argc);
+    for (int i=1; i<argc; i++)
+        c->args[i-1]=arena_strdup(&a->arena, argv[i]);
+    c->args[argc-1]=NULL;
+    c->arg_count=argc-1;
+    c->background=true;
+    a->command=c;
+    for (int i=0; i<argc; i++)
+        len+=strlen(argv[i])+1;
+    char *p=a->cmdline=arena_alloc(&a->arena, len);
+    for (int i=0; i<argc; i++)
+        p+=sprintf(p, i>0 ? " %s" : "%s", argv[i]);
+    alarm_heap[alarm_count++]=a;
+    alarm_sift_up(alarm_count-1);
+    alarm_rearm();
+    return a->id;
+}
+/**
+ * Start the commands of every alarm whose deadline has passed
+ * @return number of commands started
+ */
+int alarm_run_due()
+{
+    uint64_t expirations;
+    struct timespec now;
+    int started=0;
+    if (alarm_fd!=-1)
+        read(alarm_fd, &expirations, sizeof(expirations));
+    clock_gettime(CLOCK_REALTIME, &now);  // not time(), its coarse clock may still be behind the timer
+    while (alarm_count>0 && alarm_heap[0]->deadline<=now.tv_sec) {
+        struct alarm_t *a=alarm_remove(0);
+        started++;
+        printf("alarm %d: %s\n", a->id, a->cmdline);
+        struct node_t *node=node_new(&a->arena, NODE_PIPELINE, NULL, NULL);
+        node->command=a->command;
+        execute_node(node);
+        alarm_free(a);
+    }
+    alarm_rearm();
+    return started;
+}
+/**
+ * Turn HH.MM, HH:MM or +SECONDS into the next matching wall-clock time
+ * @return the deadline or -1 if the time can not be parsed
+ */
+time_t alarm_parse_time(const char *spec)
+{
+    char *end;
+    time_t now=time(NULL);
+    if (spec[0]=='+') {
+        long secs=strtol(spec+1, &end, 10);
+        return (*end==0 && secs>=0) ? now+secs : -1;
     }
-    else {  // when the child finishes execution runPipe() is recursively called again to execute the rest of the commands in the command->next
-        wait(0);
-        close(fdpipe[1]);
-        if (cmdtmp->arg_count==0) {
-            cmdtmp->args = (char **) realloc(
-                    cmdtmp->args, sizeof(char *) * (cmdtmp->arg_count += 1));
+    long hr=strtol(spec, &end, 10);
+    if (end==spec || (*end!='.' && *end!=':'))
+        return -1;
+    const char *m=end+1;
+    long min=strtol(m, &end, 10);
+    if (end==m || *end!=0 || hr<0 || hr>23 || min<0 || min>59)
+        return -1;
 
-            cmdtmp->args[0] = strdup(cmdtmp->name);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    tm.tm_hour=hr;
+    tm.tm_min=min;
+    tm.tm_sec=0;
+    tm.tm_isdst=-1;
+    time_t deadline=mktime(&tm);
+    if (deadline<=now) {  // already passed today, ring tomorrow
+        tm.tm_mday++;
+        tm.tm_isdst=-1;
+        deadline=mktime(&tm);
+    }
+    return deadline;
+}
+void alarm_list()
+{
+    // show the alarms in the order they will go off without disturbing the heap
+    struct alarm_t **sorted=malloc(sizeof(struct alarm_t *)*(alarm_count+1));
+    memcpy(sorted, alarm_heap, sizeof(struct alarm_t *)*alarm_count);
+    for (int i=1; i<alarm_count; i++)
+        for (int j=i; j>0 && sorted[j-1]->deadline>sorted[j]->deadline; j--) {
+            struct alarm_t *tmp=sorted[j];
+            sorted[j]=sorted[j-1];
+            sorted[j-1]=tmp;
         }
-        runPipe(cmdtmp,fdpipe[0]);
-        return;
+    for (int i=0; i<alarm_count; i++) {
+        char when[32];
+        struct tm tm;
+        localtime_r(&sorted[i]->deadline, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+        printf("%3d  %s  %s\n", sorted[i]->id, when, sorted[i]->cmdline);
     }
+    free(sorted);
+}
+/**
+ * Cancel a pending alarm
+ * @return 0 on success, -1 if there is no alarm with that id
+ */
+int alarm_cancel(int id)
+{
+    for (int i=0; i<alarm_count; i++)
+        if (alarm_heap[i]->id==id) {
+            alarm_free(alarm_remove(i));
+            alarm_rearm();
+            return 0;
+        }
+    return -1;
 }